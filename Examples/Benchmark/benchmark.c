@@ -0,0 +1,366 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L
+#endif
+#include "stdint.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+/**
+ * @brief Benchmarks the C parser example rules on a generated C-like corpus
+ * Usage: benchmark [--size=MB] [--mix=mixed|comments|strings|identifiers] [--seed=N]
+ *                  [--runs=N] [--mode=all|file|readahead|string|mapped] [--keep] [--profile]
+ * The corpus only depends on the size, mix and seed so results can be compared between versions.
+ * Every mode is run --runs times and the fastest run is reported. The peak RSS is the one of the
+ * whole process so far, run a single --mode to get the peak of that mode alone.
+ * --profile turns on the rule profiler and prints the counters of the last run of every mode,
+ * the throughput then includes the profiling overhead
+ * Link with -pthread on POSIX systems (readahead reads the corpus on a second thread)
+ */
+
+// Count the allocations Tok-A makes by routing them through our own functions
+static uint64_t allocationCount = 0;
+static void *CountedMalloc(size_t size)
+{
+    allocationCount++;
+    return malloc(size);
+}
+static void *CountedCalloc(size_t count, size_t size)
+{
+    allocationCount++;
+    return calloc(count, size);
+}
+static void *CountedRealloc(void *pointer, size_t size)
+{
+    allocationCount++;
+    return realloc(pointer, size);
+}
+#define TOKA_MALLOC(SIZE) CountedMalloc(SIZE)
+#define TOKA_CALLOC(COUNT, SIZE) CountedCalloc(COUNT, SIZE)
+#define TOKA_REALLOC(POINTER, SIZE) CountedRealloc(POINTER, SIZE)
+#define TOKA_THREADS
+#include "../C Parser/CRules.h"
+
+#if defined(_WIN32)
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <time.h>
+#endif
+
+typedef struct
+{
+    uint64_t size;
+    const char *mix;
+    uint64_t seed;
+    int runs;
+    const char *mode;
+    bool keep;
+    bool profile;
+} BenchmarkOptions;
+
+// xorshift64*, the corpus must be the same on every platform so rand() is not used
+static uint64_t NextRandom(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static double Now(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+#endif
+}
+
+static double PeakRSSMegabytes(void)
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return counters.PeakWorkingSetSize / (1024.0 * 1024.0);
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+    return usage.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+static const char *Words[] = {"buffer", "count", "index", "value", "result", "length", "node", "parser",
+                              "token", "state", "offset", "cursor", "table", "entry", "size", "next"};
+static const char *Types[] = {"int", "long", "char", "float", "double", "unsigned", "short", "bool"};
+
+static void WriteIdentifier(FILE *file, uint64_t *random)
+{
+    fprintf(file, "%s", Words[NextRandom(random) % 16]);
+    if (NextRandom(random) % 2)
+        fprintf(file, "_%s", Words[NextRandom(random) % 16]);
+    if (NextRandom(random) % 3 == 0)
+        fprintf(file, "%d", (int)(NextRandom(random) % 100));
+}
+
+static void WriteWords(FILE *file, uint64_t *random, int count)
+{
+    for (int i = 0; i < count; i++)
+        fprintf(file, "%s%s", (i > 0) ? " " : "", Words[NextRandom(random) % 16]);
+}
+
+/** @brief Writes one statement, the mix sets the odds of each kind of statement
+*/
+static void WriteStatement(FILE *file, uint64_t *random, const int *weights)
+{
+    int total = weights[0] + weights[1] + weights[2] + weights[3];
+    int pick = (int)(NextRandom(random) % total);
+    if ((pick -= weights[0]) < 0)
+    {
+        // Comments
+        if (NextRandom(random) % 2)
+        {
+            fprintf(file, "    /* ");
+            WriteWords(file, random, 8 + (int)(NextRandom(random) % 40));
+            fprintf(file, "\n       ");
+            WriteWords(file, random, 8 + (int)(NextRandom(random) % 40));
+            fprintf(file, " */\n");
+        }
+        else
+        {
+            fprintf(file, "    // ");
+            WriteWords(file, random, 4 + (int)(NextRandom(random) % 12));
+            fprintf(file, "\n");
+        }
+    }
+    else if ((pick -= weights[1]) < 0)
+    {
+        // String literals
+        fprintf(file, "    printf(\"");
+        WriteWords(file, random, 2 + (int)(NextRandom(random) % 16));
+        fprintf(file, " %%d\", ");
+        WriteIdentifier(file, random);
+        fprintf(file, ");\n");
+    }
+    else if ((pick -= weights[2]) < 0)
+    {
+        // Identifier heavy declarations and expressions
+        fprintf(file, "    %s ", Types[NextRandom(random) % 8]);
+        WriteIdentifier(file, random);
+        fprintf(file, " = ");
+        WriteIdentifier(file, random);
+        for (int i = (int)(NextRandom(random) % 4); i > 0; i--)
+        {
+            fprintf(file, " %c ", "+-*/"[NextRandom(random) % 4]);
+            WriteIdentifier(file, random);
+        }
+        fprintf(file, ";\n");
+    }
+    else
+    {
+        // Numbers and control flow
+        fprintf(file, "    if (");
+        WriteIdentifier(file, random);
+        fprintf(file, " > %d)\n        ", (int)(NextRandom(random) % 1000));
+        WriteIdentifier(file, random);
+        fprintf(file, " = %d.%df;\n", (int)(NextRandom(random) % 100), (int)(NextRandom(random) % 100));
+    }
+}
+
+static bool GenerateCorpus(const char *path, const BenchmarkOptions *options)
+{
+    // Weights of comments, strings, identifiers and numbers
+    int weights[4] = {1, 1, 1, 1};
+    if (strcmp(options->mix, "comments") == 0)
+        weights[0] = 8;
+    else if (strcmp(options->mix, "strings") == 0)
+        weights[1] = 8;
+    else if (strcmp(options->mix, "identifiers") == 0)
+        weights[2] = 8;
+    else if (strcmp(options->mix, "mixed") != 0)
+        return false;
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+        return false;
+    uint64_t random = options->seed * 2 + 1;
+    uint64_t function = 0;
+    while ((uint64_t)ftell(file) < options->size)
+    {
+        fprintf(file, "int function%lu(int argument)\n{\n", (unsigned long)function++);
+        for (int i = 0; i < 20; i++)
+            WriteStatement(file, &random, weights);
+        fprintf(file, "    return argument;\n}\n\n");
+    }
+    fclose(file);
+    return true;
+}
+
+static void AddCRules(ParserContext *ctx, bool reader)
+{
+    ParsingFunction pf;
+    if (reader)
+    {
+        pf.readerFunction = ConsumeString_R;
+        AddParseRule(ctx, "String", IsStringStart, pf);
+        pf.readerFunction = ConsumeComment_R;
+        AddParseRule(ctx, "Comment", IsCommentStart, pf);
+        pf.readerFunction = ConsumeChar_R;
+        AddParseRule(ctx, "Char", IsCharStart, pf);
+        pf.readerFunction = ConsumeNumber_R;
+        AddParseRule(ctx, "Number", IsNumeric, pf);
+        pf.readerFunction = ConsumeIdentifier_R;
+        AddParseRule(ctx, "Identifier", IsIdentiferStart, pf);
+        pf.readerFunction = ConsumeSingleCharToken_R;
+        AddParseRule(ctx, "Single Character token", IsSingleCharToken, pf);
+        pf.readerFunction = ConsumeWhiteSpace_R;
+        AddParseRule(ctx, "White space muncher", IsWhiteSpace, pf);
+    }
+    else if (ctx->fileMode)
+    {
+        pf.fileFunction = ConsumeString_F;
+        AddParseRule(ctx, "String", IsStringStart, pf);
+        pf.fileFunction = ConsumeComment_F;
+        AddParseRule(ctx, "Comment", IsCommentStart, pf);
+        pf.fileFunction = ConsumeChar_F;
+        AddParseRule(ctx, "Char", IsCharStart, pf);
+        pf.fileFunction = ConsumeNumber_F;
+        AddParseRule(ctx, "Number", IsNumeric, pf);
+        pf.fileFunction = ConsumeIdentifier_F;
+        AddParseRule(ctx, "Identifier", IsIdentiferStart, pf);
+        pf.fileFunction = ConsumeSingleCharToken_F;
+        AddParseRule(ctx, "Single Character token", IsSingleCharToken, pf);
+        pf.fileFunction = ConsumeWhiteSpace_F;
+        AddParseRule(ctx, "White space muncher", IsWhiteSpace, pf);
+    }
+    else
+    {
+        pf.stringFunction = ConsumeString_S;
+        AddParseRule(ctx, "String", IsStringStart, pf);
+        pf.stringFunction = ConsumeComment_S;
+        AddParseRule(ctx, "Comment", IsCommentStart, pf);
+        pf.stringFunction = ConsumeChar_S;
+        AddParseRule(ctx, "Char", IsCharStart, pf);
+        pf.stringFunction = ConsumeNumber_S;
+        AddParseRule(ctx, "Number", IsNumeric, pf);
+        pf.stringFunction = ConsumeIdentifier_S;
+        AddParseRule(ctx, "Identifier", IsIdentiferStart, pf);
+        pf.stringFunction = ConsumeSingleCharToken_S;
+        AddParseRule(ctx, "Single Character token", IsSingleCharToken, pf);
+        pf.stringFunction = ConsumeWhiteSpace_S;
+        AddParseRule(ctx, "White space muncher", IsWhiteSpace, pf);
+    }
+    CompileRules(ctx);
+    SetCKeywords(ctx);
+}
+
+/** @brief Parses the corpus runs times in one mode and prints the fastest run
+    @note file: Parse in file mode with the '_F' rules. readahead: ParseFileReadAhead with the
+    '_R' rules. string: the whole corpus in memory parsed with Parse in string mode. mapped:
+    ParseMappedFile with span tokens
+*/
+static void RunMode(const char *mode, const char *path, const BenchmarkOptions *options)
+{
+    bool readAhead = (strcmp(mode, "readahead") == 0);
+    bool fileMode = readAhead || (strcmp(mode, "file") == 0);
+    ParserContext ctx = CreateParserContext(fileMode);
+    AddCRules(&ctx, readAhead);
+    ctx.spanTokens = (strcmp(mode, "mapped") == 0);
+    EnableRuleProfiling(&ctx, options->profile);
+    char *text = NULL;
+    MappedFile corpus;
+    if (strcmp(mode, "string") == 0)
+    {
+        // Read up front so the time only covers tokenizing
+        MapFile(path, &corpus);
+        text = (char *)malloc(corpus.size + 1);
+        memcpy(text, corpus.data, corpus.size + 1);
+        UnmapFile(&corpus);
+    }
+    double best = 0;
+    uint64_t tokens = 0, allocations = 0, bytes = 0;
+    ReadAheadStats stats;
+    for (int run = 0; run < options->runs; run++)
+    {
+        ResetContext(false, &ctx);
+        ResetRuleProfiles(&ctx);
+        uint64_t allocationsBefore = allocationCount;
+        double start = Now();
+        if (strcmp(mode, "mapped") == 0)
+            ParseMappedFile(&ctx, (char *)path);
+        else if (readAhead)
+            ParseFileReadAhead(&ctx, (char *)path, 1 << 20, &stats);
+        else
+            Parse(&ctx, fileMode ? (char *)path : text);
+        double time = Now() - start;
+        if ((run == 0) || (time < best))
+            best = time;
+        tokens = ctx.tokens.size;
+        allocations = allocationCount - allocationsBefore;
+        bytes = (strcmp(mode, "string") == 0) ? ctx.sourceSize : (uint64_t)ctx.cursorOffset;
+    }
+    double megabytes = bytes / (1024.0 * 1024.0);
+    printf("%-9s %10.1f %12.2f %12lu %14lu %12.1f\n", mode, megabytes / best, tokens / best / 1e6,
+           (unsigned long)tokens, (unsigned long)allocations, PeakRSSMegabytes());
+    if (readAhead)
+        PrintReadAheadStats(&stats, stdout);
+    if (options->profile)
+        PrintRuleProfiles(&ctx, stdout);
+    FreeParserContext(&ctx);
+    free(text);
+}
+
+int main(int argc, char **argv)
+{
+    BenchmarkOptions options = {16 * 1024 * 1024, "mixed", 1, 3, "all", false, false};
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--size=", 7) == 0)
+            options.size = (uint64_t)(atof(argv[i] + 7) * 1024 * 1024);
+        else if (strncmp(argv[i], "--mix=", 6) == 0)
+            options.mix = argv[i] + 6;
+        else if (strncmp(argv[i], "--seed=", 7) == 0)
+            options.seed = strtoull(argv[i] + 7, NULL, 10);
+        else if (strncmp(argv[i], "--runs=", 7) == 0)
+            options.runs = atoi(argv[i] + 7);
+        else if (strncmp(argv[i], "--mode=", 7) == 0)
+            options.mode = argv[i] + 7;
+        else if (strcmp(argv[i], "--keep") == 0)
+            options.keep = true;
+        else if (strcmp(argv[i], "--profile") == 0)
+            options.profile = true;
+        else
+        {
+            printf("Usage: %s [--size=MB] [--mix=mixed|comments|strings|identifiers] [--seed=N] [--runs=N]\n"
+                   "       [--mode=all|file|readahead|string|mapped] [--keep] [--profile]\n",
+                   argv[0]);
+            return 1;
+        }
+    }
+    if (options.runs < 1)
+        options.runs = 1;
+    const char *path = "benchmark_corpus.c";
+    if (!GenerateCorpus(path, &options))
+    {
+        printf("Could not generate the corpus (unknown mix or unwritable directory)\n");
+        return 1;
+    }
+    printf("Corpus: %s, %.1f MB, mix %s, seed %lu, best of %d runs\n", path, options.size / (1024.0 * 1024.0),
+           options.mix, (unsigned long)options.seed, options.runs);
+    printf("%-9s %10s %12s %12s %14s %12s\n", "mode", "MB/s", "Mtokens/s", "tokens", "allocations", "peak RSS MB");
+    const char *modes[] = {"file", "readahead", "string", "mapped"};
+    for (int i = 0; i < 4; i++)
+    {
+        if ((strcmp(options.mode, "all") == 0) || (strcmp(options.mode, modes[i]) == 0))
+            RunMode(modes[i], path, &options);
+    }
+    if (!options.keep)
+        remove(path);
+}
@@ -37,7 +37,7 @@ static char SingleCharTokens[SINGLE_CHAR_TOKEN_COUNT] = {
     '#',
     '{',
     '}'};
-static char *SingleCharTokenNames[SINGLE_CHAR_TOKEN_COUNT] = {
+static const char *SingleCharTokenNames[SINGLE_CHAR_TOKEN_COUNT] = {
     "TILDA",
     "DBL_QUOTE",
     "SNGL_QUOTE",
@@ -164,12 +164,36 @@ enum TokenTypes
     COMMA,
     AMPERSAND,
     HASHTAG,
+    L_SQUIGGLYBRACK,
+    R_SQUIGGLYBRACK,
     STRING_LITERAL,
     CHAR_LITERAL,
     INTEGER,
     FLOAT,
-    IDENTIFIER
+    IDENTIFIER,
+    FIRST_KEYWORD // Keywords[i] gets the id FIRST_KEYWORD + i
 };
+// Words of the character classes below (see CHAR_CLASS_CONSTANT), the number is the word
+#define C_ALPHABETIC_1 (CHAR_BITS('A', 'Z') | CHAR_BITS('a', 'z'))
+#define C_DIGITS_0 CHAR_BITS('0', '9')
+#define C_WHITE_SPACE_0 (CHAR_BITS(' ', ' ') | CHAR_BITS('\n', '\n'))
+// The bytes of SingleCharTokens, keep them in sync
+#define C_SINGLE_CHAR_0 (CHAR_BITS('!', '#') | CHAR_BITS('%', '/') | CHAR_BITS(';', '>'))
+#define C_SINGLE_CHAR_1 (CHAR_BITS('[', '^') | CHAR_BITS('{', '{') | CHAR_BITS('}', '~'))
+// Character classes of the C tokens, constant so they are ready before anything runs (and
+// threads only ever read them)
+static CharClass AlphabeticClass = CHAR_CLASS_CONSTANT(0, C_ALPHABETIC_1, 0, 0);
+static CharClass NumericClass = CHAR_CLASS_CONSTANT(C_DIGITS_0 | CHAR_BITS('.', '.'), 0, 0, 0);
+static CharClass AlphaNumericClass = CHAR_CLASS_CONSTANT(C_DIGITS_0, C_ALPHABETIC_1, 0, 0);
+static CharClass IdentifierStartClass = CHAR_CLASS_CONSTANT(0, C_ALPHABETIC_1 | CHAR_BITS('_', '_'), 0, 0);
+static CharClass SingleCharClass = CHAR_CLASS_CONSTANT(C_SINGLE_CHAR_0, C_SINGLE_CHAR_1, 0, 0);
+static CharClass WhiteSpaceClass = CHAR_CLASS_CONSTANT(C_WHITE_SPACE_0, 0, 0, 0);
+// Characters that end an identifier (white space and single character tokens), and the ones an
+// identifier is made of (anything else but NUL)
+static CharClass IdentifierStopClass = CHAR_CLASS_CONSTANT(C_WHITE_SPACE_0 | C_SINGLE_CHAR_0, C_SINGLE_CHAR_1, 0, 0);
+static CharClass IdentifierBodyClass =
+    CHAR_CLASS_CONSTANT(~(C_WHITE_SPACE_0 | C_SINGLE_CHAR_0 | 1ULL), ~C_SINGLE_CHAR_1, ~0ULL, ~0ULL);
+
 // Parsing condition functions
 bool IsAlphaNumeric(char c);
 bool IsAlphabetic(char c);
@@ -182,15 +206,17 @@ bool IsCharStart(char c);
 bool IsIdentiferStart(char c);
 bool IsSingleCharToken(char c);
 
-// This function will take a token and set the value of its type if it's a keyword
-bool KeywordFilter(Token *t);
+// Gives the context the keyword table of C so KeywordFilter can recognize them
+void SetCKeywords(ParserContext *ctx);
+// This function will take a token and its text and set the value of its type if it's a keyword
+bool KeywordFilter(ParserContext *ctx, Token *t, const char *text, uint64_t length);
 // This function will take any token and set it to an integer, or float
 bool FormatFilter(Token *t);
 
 // Parsing functions
 // There are two parsing modes, one for parsing strings, the other is for parsing files
 // We will define any parsing function for the file with the '_F' suffix and the the string
-// parsing functions with the '_S'
+// parsing functions with the '_S' ('_R' ones read an InputSource, see ParseReader)
 // You only need to define a single set of the functions depending on whether you're planning to parse a file
 // Or string
 
@@ -202,17 +228,35 @@ void ConsumeChar_F(ParserContext *ctx, char c, FILE *file);
 void ConsumeIdentifier_F(ParserContext *ctx, char c, FILE *file);
 void ConsumeNumber_F(ParserContext *ctx, char c, FILE *file);
 
+void ConsumeWhiteSpace_R(ParserContext *ctx, char c, InputSource *in);
+void ConsumeComment_R(ParserContext *ctx, char c, InputSource *in);
+void ConsumeSingleCharToken_R(ParserContext *ctx, char c, InputSource *in);
+void ConsumeString_R(ParserContext *ctx, char c, InputSource *in);
+void ConsumeChar_R(ParserContext *ctx, char c, InputSource *in);
+void ConsumeIdentifier_R(ParserContext *ctx, char c, InputSource *in);
+void ConsumeNumber_R(ParserContext *ctx, char c, InputSource *in);
+// Takes in back to the cursor after a '_R' rule failed on c
+void RewindFailedRule_R(ParserContext *ctx, InputSource *in, int c);
+
+void ConsumeWhiteSpace_S(ParserContext *ctx, char c, char *str);
+void ConsumeComment_S(ParserContext *ctx, char c, char *str);
+void ConsumeSingleCharToken_S(ParserContext *ctx, char c, char *str);
+void ConsumeString_S(ParserContext *ctx, char c, char *str);
+void ConsumeChar_S(ParserContext *ctx, char c, char *str);
+void ConsumeIdentifier_S(ParserContext *ctx, char c, char *str);
+void ConsumeNumber_S(ParserContext *ctx, char c, char *str);
+
 inline bool IsAlphaNumeric(char c)
 {
-    return (IsAlphabetic(c) || (IsNumeric(c) && (c != '.')));
+    return CHAR_CLASS_HAS(AlphaNumericClass, c);
 }
 inline bool IsAlphabetic(char c)
 {
-    return ((c >= 'A') && (c <= 'Z')) || ((c >= 'a') && (c <= 'z'));
+    return CHAR_CLASS_HAS(AlphabeticClass, c);
 }
 inline bool IsNumeric(char c)
 {
-    return (((c >= '0') && (c <= '9')) || (c == '.'));
+    return CHAR_CLASS_HAS(NumericClass, c);
 }
 inline bool IsStringStart(char c)
 {
@@ -224,39 +268,35 @@ inline bool IsCharStart(char c)
 }
 inline bool IsIdentiferStart(char c)
 {
-    return (IsAlphabetic(c) || (c == '_'));
+    return CHAR_CLASS_HAS(IdentifierStartClass, c);
 }
 inline bool IsSingleCharToken(char c)
 {
-    for (int i = 0; i < SINGLE_CHAR_TOKEN_COUNT; i++)
-    {
-        if (SingleCharTokens[i] == c)
-        {
-            return true;
-        }
-    }
-    return false;
+    return CHAR_CLASS_HAS(SingleCharClass, c);
 }
 inline bool IsWhiteSpace(char c)
 {
-    return ((c == ' ') || (c == '\n'));
+    return CHAR_CLASS_HAS(WhiteSpaceClass, c);
 }
 inline bool IsCommentStart(char c)
 {
     return c == '/';
 }
-inline bool KeywordFilter(Token *t)
+inline void SetCKeywords(ParserContext *ctx)
 {
+    Keyword keywords[KEYWORD_TOKEN_COUNT];
     for (int i = 0; i < KEYWORD_TOKEN_COUNT; i++)
     {
-        if (strcmp(Keywords[i], t->value.arr) == 0)
-        {
-            t->typeId = SINGLE_CHAR_TOKEN_COUNT + i;
-            t->type = (char *)KeywordNames[i];
-            return true;
-        }
+        keywords[i].text = Keywords[i];
+        keywords[i].typeId = FIRST_KEYWORD + i;
+        keywords[i].name = KeywordNames[i];
     }
-    return false;
+    SetKeywords(ctx, keywords, KEYWORD_TOKEN_COUNT);
+}
+inline bool KeywordFilter(ParserContext *ctx, Token *t, const char *text, uint64_t length)
+{
+    // One hash of the text instead of comparing it against every keyword
+    return ClassifyKeyword(&ctx->keywords, t, text, length);
 }
 inline bool FormatFilter(Token *t)
 {
@@ -356,9 +396,6 @@ void ConsumeComment_F(ParserContext *ctx, char c, FILE *file)
 inline void ConsumeSingleCharToken_F(ParserContext *ctx, char c, FILE *file)
 {
     Token t;
-    INIT_ARRAY(char, t.value, 2);
-    APPEND_TO_ARRAY(char, t.value, c)
-    APPEND_TO_ARRAY(char, t.value, '\0')
     for (int i = 0; i < SINGLE_CHAR_TOKEN_COUNT; i++)
     {
         if (c == SingleCharTokens[i])
@@ -370,27 +407,28 @@ inline void ConsumeSingleCharToken_F(ParserContext *ctx, char c, FILE *file)
             break;
         }
     }
+    AppendTokenText(ctx, t, ctx->cursorOffset - 1, &c, 1);
     ctx->charNumber++;
     ctx->cursorOffset++;
-    SHRINK_ARRAY(char, t.value)
-    APPEND_TO_ARRAY(Token, ctx->tokens, t)
 }
 void ConsumeString_F(ParserContext *ctx, char c, FILE *file)
 {
     Token t;
     t.line = ctx->lineNumber;
     t.at = ctx->charNumber;
-    INIT_ARRAY(char, t.value, 0);
+    // The text is collected in the context scratch buffer and only copied on success
+    ctx->scratch.size = 0;
+    long start = ctx->cursorOffset - 1;
     long at = ctx->charNumber;
     long cursorPos = ctx->cursorOffset;
-    APPEND_TO_ARRAY(char, t.value, c)
+    APPEND_TO_ARRAY(char, ctx->scratch, c)
     cursorPos += 1;
     at += 1;
     c = fgetc(file);
     bool escape = false;
     while ((c != EOF) && (c != '\n') && (!escape))
     {
-        APPEND_TO_ARRAY(char, t.value, c)
+        APPEND_TO_ARRAY(char, ctx->scratch, c)
         if (c == '\"')
         {
             ctx->cursorOffset = cursorPos;
@@ -406,17 +444,14 @@ void ConsumeString_F(ParserContext *ctx, char c, FILE *file)
         cursorPos++;
         c = fgetc(file);
     }
-    // Failed parse (Free string)
+    // Failed parse
     if (ctx->cursorOffset != cursorPos)
     {
-        FREE_ARRAY(t.value);
         fseek(file, ctx->cursorOffset, SEEK_SET);
     }
     else
     {
-        APPEND_TO_ARRAY(char, t.value, '\0')
-        SHRINK_ARRAY(char, t.value)
-        APPEND_TO_ARRAY(Token, ctx->tokens, t)
+        AppendTokenText(ctx, t, start, ctx->scratch.arr, ctx->scratch.size);
     };
 }
 void ConsumeChar_F(ParserContext *ctx, char c, FILE *file)
@@ -424,17 +459,19 @@ void ConsumeChar_F(ParserContext *ctx, char c, FILE *file)
     Token t;
     t.line = ctx->lineNumber;
     t.at = ctx->charNumber;
-    INIT_ARRAY(char, t.value, 0);
+    // The text is collected in the context scratch buffer and only copied on success
+    ctx->scratch.size = 0;
+    long start = ctx->cursorOffset - 1;
     long at = ctx->charNumber;
     long cursorPos = ctx->cursorOffset;
     bool escape = false, charFound = false;
-    APPEND_TO_ARRAY(char, t.value, c);
+    APPEND_TO_ARRAY(char, ctx->scratch, c);
     cursorPos += 1;
     at++;
     c = fgetc(file);
     while ((c != EOF) && (c != '\n'))
     {
-        APPEND_TO_ARRAY(char, t.value, c)
+        APPEND_TO_ARRAY(char, ctx->scratch, c)
         if ((c == '\'') && (!escape))
         {
             ctx->cursorOffset = cursorPos;
@@ -455,17 +492,14 @@ void ConsumeChar_F(ParserContext *ctx, char c, FILE *file)
         cursorPos++;
         c = fgetc(file);
     }
-    // Failed parse (Free string)
+    // Failed parse
     if (ctx->cursorOffset != cursorPos)
     {
-        FREE_ARRAY(t.value);
         fseek(file, ctx->cursorOffset, SEEK_SET);
     }
     else
     {
-        APPEND_TO_ARRAY(char, t.value, '\0')
-        SHRINK_ARRAY(char, t.value)
-        APPEND_TO_ARRAY(Token, ctx->tokens, t)
+        AppendTokenText(ctx, t, start, ctx->scratch.arr, ctx->scratch.size);
     };
 }
 void ConsumeIdentifier_F(ParserContext *ctx, char c, FILE *file)
@@ -473,12 +507,14 @@ void ConsumeIdentifier_F(ParserContext *ctx, char c, FILE *file)
     Token t;
     t.line = ctx->lineNumber;
     t.at = ctx->charNumber;
-    INIT_ARRAY(char, t.value, 0);
+    // The text is collected in the context scratch buffer and only copied on success
+    ctx->scratch.size = 0;
+    long start = ctx->cursorOffset - 1;
     long at = ctx->charNumber;
     long cursorPos = ctx->cursorOffset;
     while (c != EOF)
     {
-        if (((!IsAlphaNumeric(c)) && (c != '_')) && ((c == '\n') || (c == ' ') || IsSingleCharToken(c)))
+        if (CHAR_CLASS_HAS(IdentifierStopClass, c))
         {
             cursorPos--;
             ctx->cursorOffset = cursorPos;
@@ -487,24 +523,21 @@ void ConsumeIdentifier_F(ParserContext *ctx, char c, FILE *file)
             ungetc(c, file);
             break;
         }
-        APPEND_TO_ARRAY(char, t.value, c)
+        APPEND_TO_ARRAY(char, ctx->scratch, c)
         cursorPos++;
         at++;
         c = fgetc(file);
     }
     // Will determine if it is a keyword
-    // Failed parse (Free string)
+    // Failed parse
     if (ctx->cursorOffset != cursorPos)
     {
-        FREE_ARRAY(t.value);
         fseek(file, ctx->cursorOffset, SEEK_SET);
     }
     else
     {
-        APPEND_TO_ARRAY(char, t.value, '\0')
-        KeywordFilter(&t);
-        SHRINK_ARRAY(char, t.value)
-        APPEND_TO_ARRAY(Token, ctx->tokens, t);
+        KeywordFilter(ctx, &t, ctx->scratch.arr, ctx->scratch.size);
+        AppendTokenText(ctx, t, start, ctx->scratch.arr, ctx->scratch.size);
     };
 }
 inline void ConsumeNumber_F(ParserContext *ctx, char c, FILE *file)
@@ -512,7 +545,9 @@ inline void ConsumeNumber_F(ParserContext *ctx, char c, FILE *file)
     Token t;
     t.line = ctx->lineNumber;
     t.at = ctx->charNumber;
-    INIT_ARRAY(char, t.value, 0);
+    // The text is collected in the context scratch buffer and only copied on success
+    ctx->scratch.size = 0;
+    long start = ctx->cursorOffset - 1;
     long at = ctx->charNumber;
     long cursorPos = ctx->cursorOffset;
     bool valid = c != '.', decimalFound = false, fFound = false;
@@ -549,35 +584,42 @@ inline void ConsumeNumber_F(ParserContext *ctx, char c, FILE *file)
         }
         else
             valid = true;
-        APPEND_TO_ARRAY(char, t.value, c)
+        APPEND_TO_ARRAY(char, ctx->scratch, c)
         cursorPos++;
         at++;
         c = fgetc(file);
     } // Will produce an integer
     // Will determine if it is a keyword
-    // Failed parse (Free string)
+    // Failed parse
     if (ctx->cursorOffset != cursorPos)
     {
-        FREE_ARRAY(t.value);
         fseek(file, ctx->cursorOffset, SEEK_SET);
     }
     else
     {
-        APPEND_TO_ARRAY(char, t.value, '\0')
-        SHRINK_ARRAY(char, t.value)
-        APPEND_TO_ARRAY(Token, ctx->tokens, t);
+        AppendTokenText(ctx, t, start, ctx->scratch.arr, ctx->scratch.size);
     };
 }
-/* STRING PARSING FUNCTIONS DECLARATIONS
-void ConsumeWhiteSpace_S(ParserContext *ctx, char c, char *str);
-void ConsumeSingleCharToken_S(ParserContext *ctx, char c, char *str);
-void ConsumeString_S(ParserContext *ctx, char c, char *str);
-void ConsumeIdentifier_S(ParserContext *ctx, char c, char *str);
-void ConsumeNumber_S(ParserContext *ctx, char c, char *str);
-*/
-/* STRING PARSING FUNCTIONS DEFINITIONS
-inline void ConsumeWhiteSpace_S(ParserContext *ctx, char c, char *str)
+// The reader versions are the file versions reading from an InputSource, going back with
+// InputUnget and InputRewind instead of ungetc and fseek, so they also work on pipes and sockets.
+// They keep what InputGet returns in an int, any byte can come from a stream and a 0xFF byte in a
+// char would pass for EOF (and EOF would never match on platforms where char is unsigned)
+
+// If what the rule read is not in the buffer any more (a token longer than the buffer lost its
+// mark) there is no going back: the token is given up, its bytes up to c are skipped without a
+// token and parsing goes on from c, so the other rules never start in the middle of it
+inline void RewindFailedRule_R(ParserContext *ctx, InputSource *in, int c)
 {
+    if (InputRewind(in, ctx->cursorOffset))
+        return;
+    InputUnget(in, c);
+    uint64_t position = InputTell(in);
+    ctx->charNumber += position - ctx->cursorOffset;
+    ctx->cursorOffset = position;
+}
+inline void ConsumeWhiteSpace_R(ParserContext *ctx, char first, InputSource *in)
+{
+    int c = (unsigned char)first;
     while (c != '\0')
     {
         if (c == ' ')
@@ -595,17 +637,66 @@ inline void ConsumeWhiteSpace_S(ParserContext *ctx, char c, char *str)
             ctx->cursorOffset--;
             if (ctx->charNumber > 1)
                 ctx->charNumber--;
+            InputUnget(in, c);
             break;
         }
-        c = str[ctx->cursorOffset];
+        c = InputGet(in);
     }
 }
-inline void ConsumeSingleCharToken_S(ParserContext *ctx, char c, char *str)
+void ConsumeComment_R(ParserContext *ctx, char first, InputSource *in)
 {
+    int c = (unsigned char)first;
+    long charNumber = ctx->charNumber;
+    c = InputGet(in);
+    charNumber++;
+    if (c == EOF || ((c != '/') && (c != '*')))
+    {
+        InputUnget(in, c);
+        return;
+    }
+    long line = ctx->lineNumber;
+    charNumber++;
+    bool multiline = false, asteriskFound = false;
+    if (c == '*')
+        multiline = true;
+    c = InputGet(in);
+    charNumber++;
+    while (c != EOF)
+    {
+        if (c == '\n')
+        {
+            line++;
+            charNumber = 1;
+        }
+        // If we got a single line comment we break on a newline
+        if ((c == '*') && (!asteriskFound))
+            asteriskFound = true;
+        else if ((!multiline) && c == '\n')
+        {
+            ctx->lineNumber = line;
+            ctx->charNumber = 1;
+            ctx->cursorOffset = InputTell(in);
+            break;
+        }
+        else if (c == '/' && asteriskFound)
+        {
+            ctx->lineNumber = line;
+            ctx->cursorOffset = InputTell(in);
+            ctx->charNumber = charNumber;
+            break;
+        }
+        else
+        {
+            asteriskFound = false;
+        }
+        c = InputGet(in);
+        charNumber++;
+    }
+}
+inline void ConsumeSingleCharToken_R(ParserContext *ctx, char c, InputSource *in)
+{
+    (void)in;
     Token t;
-    INIT_ARRAY(char, t.value, 2);
-    APPEND_TO_ARRAY(char, t.value, c)
-    APPEND_TO_ARRAY(char, t.value, '\0')
     for (int i = 0; i < SINGLE_CHAR_TOKEN_COUNT; i++)
     {
         if (c == SingleCharTokens[i])
@@ -617,102 +708,158 @@ inline void ConsumeSingleCharToken_S(ParserContext *ctx, char c, char *str)
             break;
         }
     }
+    AppendTokenText(ctx, t, ctx->cursorOffset - 1, &c, 1);
     ctx->charNumber++;
     ctx->cursorOffset++;
-    APPEND_TO_ARRAY(Token, ctx->tokens, t)
 }
-
-void ConsumeString_S(ParserContext *ctx, char c, char *str)
+void ConsumeString_R(ParserContext *ctx, char first, InputSource *in)
 {
+    int c = (unsigned char)first;
     Token t;
-    if (c != '\"')
-        return;
     t.line = ctx->lineNumber;
     t.at = ctx->charNumber;
-    INIT_ARRAY(char, t.value, 0);
+    // The text is collected in the context scratch buffer and only copied on success
+    ctx->scratch.size = 0;
+    long start = ctx->cursorOffset - 1;
     long at = ctx->charNumber;
     long cursorPos = ctx->cursorOffset;
-    bool firstQuote = true;
-    while ((c != '\0') && (c != '\n'))
+    APPEND_TO_ARRAY(char, ctx->scratch, c)
+    cursorPos += 1;
+    at += 1;
+    c = InputGet(in);
+    bool escape = false;
+    while ((c != EOF) && (c != '\n') && (!escape))
     {
-        APPEND_TO_ARRAY(char, t.value, c)
+        APPEND_TO_ARRAY(char, ctx->scratch, c)
         if (c == '\"')
         {
-            if (!firstQuote)
-            {
-                cursorPos += 1;
-                ctx->cursorOffset = cursorPos;
-                ctx->charNumber = at;
-                SET_TOKEN_ENUM_TYPE(t, STRING_LITERAL)
-                break;
-            }
-            else
-                firstQuote = false;
+            ctx->cursorOffset = cursorPos;
+            ctx->charNumber = at;
+            SET_TOKEN_ENUM_TYPE(t, STRING_LITERAL)
+            break;
         }
+        else if ((c == '\\') && (!escape))
+            escape = true;
+        else
+            escape = false;
         at++;
         cursorPos++;
-        c = str[cursorPos];
+        c = InputGet(in);
     }
-    // Failed parse (Free string)
+    // Failed parse
     if (ctx->cursorOffset != cursorPos)
     {
-        FREE_ARRAY(t.value);
+        RewindFailedRule_R(ctx, in, c);
     }
     else
     {
-        APPEND_TO_ARRAY(char, t.value, '\0')
-        APPEND_TO_ARRAY(Token, ctx->tokens, t);
+        AppendTokenText(ctx, t, start, ctx->scratch.arr, ctx->scratch.size);
     };
 }
-
-void ConsumeIdentifier_S(ParserContext *ctx, char c, char *str)
+void ConsumeChar_R(ParserContext *ctx, char first, InputSource *in)
 {
+    int c = (unsigned char)first;
     Token t;
     t.line = ctx->lineNumber;
     t.at = ctx->charNumber;
-    INIT_ARRAY(char, t.value, 0);
+    // The text is collected in the context scratch buffer and only copied on success
+    ctx->scratch.size = 0;
+    long start = ctx->cursorOffset - 1;
     long at = ctx->charNumber;
     long cursorPos = ctx->cursorOffset;
-    while (c != '\0' && (IsAlphaNumeric(c) || c == '_'))
+    bool escape = false, charFound = false;
+    APPEND_TO_ARRAY(char, ctx->scratch, c);
+    cursorPos += 1;
+    at++;
+    c = InputGet(in);
+    while ((c != EOF) && (c != '\n'))
     {
-        if ((c == '\n') || (c == ' ') || IsSingleCharToken(c))
+        APPEND_TO_ARRAY(char, ctx->scratch, c)
+        if ((c == '\'') && (!escape))
+        {
+            ctx->cursorOffset = cursorPos;
+            ctx->charNumber = at;
+            SET_TOKEN_ENUM_TYPE(t, CHAR_LITERAL)
+            break;
+        }
+        else if (c == '\\' && (!escape))
+            escape = true;
+        else if ((c != '\'') && (charFound) && (!escape))
+            break;
+        else
+        {
+            escape = false;
+            charFound = true;
+        }
+        at++;
+        cursorPos++;
+        c = InputGet(in);
+    }
+    // Failed parse
+    if (ctx->cursorOffset != cursorPos)
+    {
+        RewindFailedRule_R(ctx, in, c);
+    }
+    else
+    {
+        AppendTokenText(ctx, t, start, ctx->scratch.arr, ctx->scratch.size);
+    };
+}
+void ConsumeIdentifier_R(ParserContext *ctx, char first, InputSource *in)
+{
+    int c = (unsigned char)first;
+    Token t;
+    t.line = ctx->lineNumber;
+    t.at = ctx->charNumber;
+    // The text is collected in the context scratch buffer and only copied on success
+    ctx->scratch.size = 0;
+    long start = ctx->cursorOffset - 1;
+    long at = ctx->charNumber;
+    long cursorPos = ctx->cursorOffset;
+    while (c != EOF)
+    {
+        if (CHAR_CLASS_HAS(IdentifierStopClass, c))
         {
             cursorPos--;
             ctx->cursorOffset = cursorPos;
             SET_TOKEN_ENUM_TYPE(t, IDENTIFIER);
             ctx->charNumber = at;
+            InputUnget(in, c);
             break;
         }
-        APPEND_TO_ARRAY(char, t.value, c)
+        APPEND_TO_ARRAY(char, ctx->scratch, c)
         cursorPos++;
         at++;
-        c = str[cursorPos];
+        c = InputGet(in);
     }
     // Will determine if it is a keyword
-    // Failed parse (Free string)
+    // Failed parse
     if (ctx->cursorOffset != cursorPos)
     {
-        FREE_ARRAY(t.value);
+        RewindFailedRule_R(ctx, in, c);
     }
     else
     {
-        APPEND_TO_ARRAY(char, t.value, '\0')
-        KeywordFilter(&t);
-        APPEND_TO_ARRAY(Token, ctx->tokens, t);
+        KeywordFilter(ctx, &t, ctx->scratch.arr, ctx->scratch.size);
+        AppendTokenText(ctx, t, start, ctx->scratch.arr, ctx->scratch.size);
     };
 }
-inline void ConsumeNumber_S(ParserContext *ctx, char c, char *str)
+inline void ConsumeNumber_R(ParserContext *ctx, char first, InputSource *in)
 {
+    int c = (unsigned char)first;
     Token t;
     t.line = ctx->lineNumber;
     t.at = ctx->charNumber;
-    INIT_ARRAY(char, t.value, 0);
+    // The text is collected in the context scratch buffer and only copied on success
+    ctx->scratch.size = 0;
+    long start = ctx->cursorOffset - 1;
     long at = ctx->charNumber;
     long cursorPos = ctx->cursorOffset;
     bool valid = c != '.', decimalFound = false, fFound = false;
-
-    while ((c != '\0') || (!IsWhiteSpace(c)))
+    // Every byte that can't continue the number, EOF included, ends the loop below
+    while (true)
     {
+        // If we found a non numeric value that is not an additional decimal point we escape
         if (c == '.' && !decimalFound)
         {
             decimalFound = true;
@@ -723,7 +870,10 @@ inline void ConsumeNumber_S(ParserContext *ctx, char c, char *str)
             if (!valid)
                 break;
             if (c != 'f')
+            {
                 cursorPos--;
+                InputUnget(in, c);
+            }
             else
                 fFound = true;
             ctx->cursorOffset = cursorPos;
@@ -740,22 +890,238 @@ inline void ConsumeNumber_S(ParserContext *ctx, char c, char *str)
         }
         else
             valid = true;
-        APPEND_TO_ARRAY(char, t.value, c)
+        APPEND_TO_ARRAY(char, ctx->scratch, c)
         cursorPos++;
         at++;
-        c = str[cursorPos];
-    }
+        c = InputGet(in);
+    } // Will produce an integer
     // Will determine if it is a keyword
-    // Failed parse (Free string)
+    // Failed parse
     if (ctx->cursorOffset != cursorPos)
     {
-        FREE_ARRAY(t.value);
+        RewindFailedRule_R(ctx, in, c);
     }
     else
     {
-        APPEND_TO_ARRAY(char, t.value, '\0')
-        APPEND_TO_ARRAY(Token, ctx->tokens, t);
+        AppendTokenText(ctx, t, start, ctx->scratch.arr, ctx->scratch.size);
     };
 }
-*/
+// The string versions receive the whole buffer being parsed and the context cursor points at c.
+// They mirror the behaviour of the file versions (including the line and character bookkeeping)
+// so parsing a file with ParseMappedFile produces the same tokens as Parse in file mode. With
+// ctx->lazyPositions set they skip the bookkeeping and only move the cursor
+inline void ConsumeWhiteSpace_S(ParserContext *ctx, char c, char *str)
+{
+    long pos = ctx->cursorOffset;
+    long end = SkipCharClass(str, pos, ctx->sourceSize, &WhiteSpaceClass);
+    // Positions will come from the newline index, only the offset matters
+    if (ctx->lazyPositions)
+    {
+        ctx->cursorOffset = end;
+        return;
+    }
+    uint64_t newlines = CountNewlines(str, pos, end);
+    if (newlines > 0)
+    {
+        // Only the spaces after the last newline count towards the character number
+        long lastNewline = end - 1;
+        while (str[lastNewline] != '\n')
+            lastNewline--;
+        ctx->lineNumber += newlines;
+        ctx->charNumber = 1 + (end - lastNewline - 1);
+    }
+    else
+        ctx->charNumber += end - pos;
+    if (ctx->charNumber > 1)
+        ctx->charNumber--;
+    ctx->cursorOffset = end;
+}
+void ConsumeComment_S(ParserContext *ctx, char c, char *str)
+{
+    static const char stops[3] = {'*', '\0', '\n'};
+    long pos = ctx->cursorOffset + 1;
+    c = str[pos];
+    NOTE_READ(ctx, pos)
+    if ((c != '/') && (c != '*'))
+        return;
+    long line = ctx->lineNumber;
+    // The character number at position p is lineStart + p
+    long lineStart = ctx->charNumber + 1 - ctx->cursorOffset;
+    bool multiline = (c == '*');
+    bool lazy = ctx->lazyPositions;
+    // Without line numbers to keep a multiline comment only stops on asterisks
+    int stopCount = (multiline && lazy) ? 2 : 3;
+    pos++;
+    while (true)
+    {
+        // Everything but these characters is skipped in bulk
+        pos = FindFirstOf(str, pos, ctx->sourceSize, stops, stopCount);
+        c = str[pos];
+        if (c == '\0')
+            break;
+        if (c == '\n')
+        {
+            line++;
+            lineStart = 1 - pos;
+            // If we got a single line comment we break on a newline
+            if (!multiline)
+            {
+                if (!lazy)
+                {
+                    ctx->lineNumber = line;
+                    ctx->charNumber = 1;
+                }
+                ctx->cursorOffset = pos + 1;
+                return;
+            }
+            pos++;
+            continue;
+        }
+        // An asterisk followed by a slash ends the comment (even a single line one)
+        c = str[++pos];
+        if (c == '/')
+        {
+            if (!lazy)
+            {
+                ctx->lineNumber = line;
+                ctx->charNumber = lineStart + pos;
+            }
+            ctx->cursorOffset = pos + 1;
+            return;
+        }
+        // A second asterisk can't start the end of the comment
+        else if (c == '*')
+            pos++;
+    }
+    // Unterminated comment, we read all the way to the end
+    NOTE_READ(ctx, pos)
+}
+inline void ConsumeSingleCharToken_S(ParserContext *ctx, char c, char *str)
+{
+    Token t;
+    for (int i = 0; i < SINGLE_CHAR_TOKEN_COUNT; i++)
+    {
+        if (c == SingleCharTokens[i])
+        {
+            t.typeId = i;
+            t.type = (char *)SingleCharTokenNames[i];
+            t.at = ctx->charNumber;
+            t.line = ctx->lineNumber;
+            break;
+        }
+    }
+    AppendToken(ctx, t, ctx->cursorOffset, 1);
+    if (!ctx->lazyPositions)
+        ctx->charNumber++;
+    ctx->cursorOffset++;
+}
+void ConsumeString_S(ParserContext *ctx, char c, char *str)
+{
+    static const char stops[4] = {'\"', '\\', '\n', '\0'};
+    long pos = FindFirstOf(str, ctx->cursorOffset + 1, ctx->sourceSize, stops, 4);
+    // Escapes are not supported, leave the quote to the single character rule
+    if (str[pos] != '\"')
+    {
+        NOTE_READ(ctx, pos)
+        return;
+    }
+    Token t;
+    t.line = ctx->lineNumber;
+    t.at = ctx->charNumber;
+    SET_TOKEN_ENUM_TYPE(t, STRING_LITERAL)
+    AppendToken(ctx, t, ctx->cursorOffset, pos + 1 - ctx->cursorOffset);
+    if (!ctx->lazyPositions)
+        ctx->charNumber += pos - ctx->cursorOffset;
+    ctx->cursorOffset = pos + 1;
+}
+void ConsumeChar_S(ParserContext *ctx, char c, char *str)
+{
+    long pos = ctx->cursorOffset + 1;
+    long at = ctx->charNumber + 1;
+    bool escape = false, charFound = false;
+    c = str[pos];
+    while ((c != '\0') && (c != '\n'))
+    {
+        if ((c == '\'') && (!escape))
+        {
+            Token t;
+            t.line = ctx->lineNumber;
+            t.at = ctx->charNumber;
+            SET_TOKEN_ENUM_TYPE(t, CHAR_LITERAL)
+            AppendToken(ctx, t, ctx->cursorOffset, pos + 1 - ctx->cursorOffset);
+            ctx->cursorOffset = pos + 1;
+            if (!ctx->lazyPositions)
+                ctx->charNumber = at;
+            return;
+        }
+        else if (c == '\\' && (!escape))
+            escape = true;
+        else if ((c != '\'') && (charFound) && (!escape))
+            break;
+        else
+        {
+            escape = false;
+            charFound = true;
+        }
+        at++;
+        c = str[++pos];
+    }
+    NOTE_READ(ctx, pos)
+}
+void ConsumeIdentifier_S(ParserContext *ctx, char c, char *str)
+{
+    long pos = SkipCharClass(str, ctx->cursorOffset, ctx->sourceSize, &IdentifierBodyClass);
+    Token t;
+    t.line = ctx->lineNumber;
+    t.at = ctx->charNumber;
+    SET_TOKEN_ENUM_TYPE(t, IDENTIFIER);
+    // Will determine if it is a keyword
+    KeywordFilter(ctx, &t, str + ctx->cursorOffset, pos - ctx->cursorOffset);
+    AppendToken(ctx, t, ctx->cursorOffset, pos - ctx->cursorOffset);
+    if (!ctx->lazyPositions)
+        ctx->charNumber += pos - ctx->cursorOffset;
+    ctx->cursorOffset = pos;
+}
+inline void ConsumeNumber_S(ParserContext *ctx, char c, char *str)
+{
+    long pos = ctx->cursorOffset;
+    bool valid = c != '.', decimalFound = false;
+    while (true)
+    {
+        // If we found a non numeric value that is not an additional decimal point we escape
+        if (c == '.' && !decimalFound)
+        {
+            decimalFound = true;
+        }
+        else if ((c == '.' && decimalFound) || (c == 'f') || (!IsNumeric(c)) ||
+                 (c != '.' && IsSingleCharToken(c)))
+        {
+            if (!valid)
+            {
+                NOTE_READ(ctx, pos)
+                return;
+            }
+            Token t;
+            t.line = ctx->lineNumber;
+            t.at = ctx->charNumber;
+            if ((c == 'f') || decimalFound)
+            {
+                SET_TOKEN_ENUM_TYPE(t, FLOAT)
+            }
+            else
+            {
+                SET_TOKEN_ENUM_TYPE(t, INTEGER)
+            }
+            AppendToken(ctx, t, ctx->cursorOffset, pos - ctx->cursorOffset);
+            if (!ctx->lazyPositions)
+                ctx->charNumber += pos - ctx->cursorOffset;
+            // The 'f' suffix is consumed but not kept in the value
+            ctx->cursorOffset = (c == 'f') ? pos + 1 : pos;
+            return;
+        }
+        else
+            valid = true;
+        c = str[++pos];
+    }
+}
 #endif
\ No newline at end of file
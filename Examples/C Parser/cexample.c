@@ -1,3 +1,4 @@
+#define TOKA_THREADS
 #include "./CRules.h"
 
 int main(int argc, char **argv)
@@ -5,54 +6,73 @@ int main(int argc, char **argv)
 
     printf("To tokenize files add the paths of the files as arguments to this executable!\n");
 
-    ParserContext ctx = CreateParserContext(true);
+    // The files are memory mapped and parsed as strings, so we use the string parsing functions.
+    // To parse through stdio instead use CreateParserContext(true), the '_F' functions and Parse
+    ParserContext ctx = CreateParserContext(false);
+    // Tokens only remember where their text is in the mapped file instead of copying it
+    ctx.spanTokens = true;
     /*
     Parsing function is a union that can either
     be a file parsing function pointer or a string parsing
     function
     */
     ParsingFunction pf;
-
-    pf.fileFunction = ConsumeString_F;
+    pf.stringFunction = ConsumeString_S;
     AddParseRule(&ctx, "String", IsStringStart, pf);
 
-    pf.fileFunction = ConsumeComment_F;
+    pf.stringFunction = ConsumeComment_S;
     AddParseRule(&ctx, "String", IsCommentStart, pf);
 
-    pf.fileFunction = ConsumeChar_F;
+    pf.stringFunction = ConsumeChar_S;
     AddParseRule(&ctx, "Char", IsCharStart, pf);
-    pf.fileFunction = ConsumeNumber_F;
-    AddParseRule(&ctx, "Number", IsNumeric, pf);
+    // A rule can also be given its character class directly instead of a condition function
+    pf.stringFunction = ConsumeNumber_S;
+    AddClassParseRule(&ctx, "Number", NumericClass, pf);
 
-    pf.fileFunction = ConsumeIdentifier_F;
-    AddParseRule(&ctx, "Identifier", IsIdentiferStart, pf);
-    pf.fileFunction = ConsumeSingleCharToken_F;
-    AddParseRule(&ctx, "Single Character token", IsSingleCharToken, pf);
+    pf.stringFunction = ConsumeIdentifier_S;
+    AddClassParseRule(&ctx, "Identifier", IdentifierStartClass, pf);
+    pf.stringFunction = ConsumeSingleCharToken_S;
+    AddClassParseRule(&ctx, "Single Character token", SingleCharClass, pf);
 
-    pf.fileFunction = ConsumeWhiteSpace_F;
-    AddParseRule(&ctx, "White space muncher", IsWhiteSpace, pf);
+    pf.stringFunction = ConsumeWhiteSpace_S;
+    AddClassParseRule(&ctx, "White space muncher", WhiteSpaceClass, pf);
+    // All of our conditions only look at their character so the rules can be compiled
+    // into a lookup table instead of testing every condition on every character
+    CompileRules(&ctx);
+    // Identifiers get classified as keywords through the context's keyword table
+    SetCKeywords(&ctx);
 
     if (argc == 1)
     {
-        Parse(&ctx, "test.c");
+        ParseMappedFile(&ctx, "test.c");
         for (int i = 0; i < ctx.tokens.size; i++)
         {
-            printf("[%ld,%ld]: %s: %s\n", ctx.tokens.arr[i].line, ctx.tokens.arr[i].at, ctx.tokens.arr[i].type, ctx.tokens.arr[i].value.arr);
+            printf("[%ld,%ld]: %s: %.*s\n", ctx.tokens.arr[i].line, ctx.tokens.arr[i].at, ctx.tokens.arr[i].type,
+                   (int)ctx.tokens.arr[i].length, TokenText(&ctx, &ctx.tokens.arr[i]));
         }
     }
     else
     {
-
-        for (int i = 1; i < argc; i++)
+        // The files are tokenized in parallel, each one by its own clone of ctx
+        FileParseResult *results = (FileParseResult *)calloc(argc - 1, sizeof(FileParseResult));
+        ParseFiles(&ctx, argv + 1, argc - 1, 0, results);
+        for (int i = 0; i < argc - 1; i++)
         {
-            printf("================File %d: %s================\n", i - 1, argv[i]);
-            Parse(&ctx, argv[i]);
-            for (int i = 0; i < ctx.tokens.size; i++)
+            printf("================File %d: %s================\n", i, results[i].path);
+            if (!results[i].parsed)
+            {
+                printf("Could not open %s\n", results[i].path);
+                continue;
+            }
+            ParserContext *fileCtx = &results[i].ctx;
+            for (int j = 0; j < fileCtx->tokens.size; j++)
             {
-                printf("[%ld,%ld]: %s: %s\n", ctx.tokens.arr[i].line, ctx.tokens.arr[i].at, ctx.tokens.arr[i].type, ctx.tokens.arr[i].value.arr);
+                printf("[%ld,%ld]: %s: %.*s\n", fileCtx->tokens.arr[j].line, fileCtx->tokens.arr[j].at, fileCtx->tokens.arr[j].type,
+                       (int)fileCtx->tokens.arr[j].length, TokenText(fileCtx, &fileCtx->tokens.arr[j]));
             }
-            ResetContext(false, &ctx);
         }
+        FreeFileParseResults(results, argc - 1);
+        free(results);
     }
     FreeParserContext(&ctx);
 }
\ No newline at end of file
@@ -0,0 +1,64 @@
+#include "../C Parser/CRules.h"
+#include "../../Toka.hpp"
+#include <chrono>
+/**
+ * @brief Tokenizes a C file with the C rules listed at compile time (toka::Lexer) and with the
+ * same rules added at runtime, checks that both give the same tokens and times them
+ * Build with a C++17 compiler: g++ -std=c++17 -O2 cppexample.cpp
+ * Usage: cppexample [source file]
+ */
+using CLexer = toka::Lexer<toka::Rule<IsStringStart, ConsumeString_S>,
+                           toka::Rule<IsCommentStart, ConsumeComment_S>,
+                           toka::Rule<IsCharStart, ConsumeChar_S>,
+                           toka::ClassRule<&NumericClass, ConsumeNumber_S>,
+                           toka::ClassRule<&IdentifierStartClass, ConsumeIdentifier_S>,
+                           toka::ClassRule<&SingleCharClass, ConsumeSingleCharToken_S>,
+                           toka::ClassRule<&WhiteSpaceClass, ConsumeWhiteSpace_S>>;
+
+static double Seconds()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, char **argv)
+{
+    char *path = (argc > 1) ? argv[1] : (char *)"../C Parser/test.c";
+    char *names[] = {(char *)"String", (char *)"Comment", (char *)"Char", (char *)"Number",
+                     (char *)"Identifier", (char *)"Single Character token", (char *)"White space muncher"};
+
+    // The runtime path: the same rules added to the context
+    ParserContext runtime = CreateParserContext(false);
+    runtime.spanTokens = true;
+    CLexer::Register(&runtime, names);
+    CompileRules(&runtime);
+    SetCKeywords(&runtime);
+
+    // The compile time path only needs the keywords, the rules are in CLexer
+    ParserContext compiled = CreateParserContext(false);
+    compiled.spanTokens = true;
+    SetCKeywords(&compiled);
+
+    double start = Seconds();
+    if (!ParseMappedFile(&runtime, path))
+    {
+        printf("Could not open %s\n", path);
+        return 1;
+    }
+    double middle = Seconds();
+    CLexer::ParseMappedFile(&compiled, path);
+    double end = Seconds();
+
+    uint64_t different = (runtime.tokens.size == compiled.tokens.size) ? 0 : 1;
+    for (uint64_t i = 0; i < runtime.tokens.size && i < compiled.tokens.size; i++)
+    {
+        Token *a = &runtime.tokens.arr[i], *b = &compiled.tokens.arr[i];
+        if (a->typeId != b->typeId || a->offset != b->offset || a->length != b->length || a->line != b->line || a->at != b->at)
+            different++;
+    }
+    printf("%lu tokens, %lu different\n", (unsigned long)compiled.tokens.size, (unsigned long)different);
+    printf("runtime rules: %.4fs\ncompile time rules: %.4fs\n", middle - start, end - middle);
+
+    FreeParserContext(&runtime);
+    FreeParserContext(&compiled);
+    return different != 0;
+}
@@ -0,0 +1,52 @@
+#include "../../Toka.h"
+/**
+ * @brief This example tokenizes the same C file as the C parser example, but every token is
+ * described by a pattern instead of a hand written parsing function. The patterns are compiled
+ * into a single DFA that finds the longest match at every position (ties go to the pattern that
+ * was added first, which is why the keywords come before the identifiers)
+ */
+enum PatternTokenTypes
+{
+    KEYWORD,
+    IDENTIFIER,
+    FLOAT,
+    INTEGER,
+    STRING_LITERAL,
+    CHAR_LITERAL,
+    OPERATOR,
+    PUNCTUATION
+};
+
+int main(int argc, char **argv)
+{
+    ParserContext ctx = CreateParserContext(false);
+    AddPatternRule(&ctx, "void|char|short|int|long|float|double|signed|unsigned|const|static|"
+                         "struct|union|enum|typedef|if|else|switch|case|default|for|do|while|"
+                         "break|continue|return|sizeof",
+                   KEYWORD, "KEYWORD");
+    AddPatternRule(&ctx, "[A-Za-z_][A-Za-z0-9_]*", IDENTIFIER, "IDENTIFIER");
+    AddPatternRule(&ctx, "\\d+\\.\\d*f?|\\.\\d+f?|\\d+f", FLOAT, "FLOAT");
+    AddPatternRule(&ctx, "0[xX][0-9a-fA-F]+|\\d+", INTEGER, "INTEGER");
+    AddPatternRule(&ctx, "\"([^\"\\\\\\n]|\\\\.)*\"", STRING_LITERAL, "STRING_LITERAL");
+    AddPatternRule(&ctx, "'([^'\\\\\\n]|\\\\.)+'", CHAR_LITERAL, "CHAR_LITERAL");
+    AddPatternRule(&ctx, "\\+\\+|--|->|[-+*/%=!<>&|^]=?|&&|\\|\\||<<|>>|~", OPERATOR, "OPERATOR");
+    AddPatternRule(&ctx, "[;,.(){}\\[\\]#?:]", PUNCTUATION, "PUNCTUATION");
+    // Patterns without a type are consumed without making a token
+    AddPatternRule(&ctx, "\\s+", 0, NULL);
+    AddPatternRule(&ctx, "//[^\\n]*", 0, NULL);
+    AddPatternRule(&ctx, "/\\*([^*]|\\*+[^*/])*\\*+/", 0, NULL);
+    CompilePatterns(&ctx);
+    printf("%u DFA states, %u byte classes\n", ctx.lexer.stateCount, ctx.lexer.classCount);
+
+    if (!ParseMappedFile(&ctx, (argc > 1) ? argv[1] : "../C Parser/test.c"))
+    {
+        printf("Could not open the file\n");
+        return 1;
+    }
+    for (int i = 0; i < ctx.tokens.size; i++)
+    {
+        printf("[%ld,%ld]: %s: %s\n", ctx.tokens.arr[i].line, ctx.tokens.arr[i].at, ctx.tokens.arr[i].type,
+               ctx.tokens.arr[i].value.arr);
+    }
+    FreeParserContext(&ctx);
+}
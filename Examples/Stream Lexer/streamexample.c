@@ -0,0 +1,46 @@
+#include "../C Parser/CRules.h"
+/**
+ * @brief Tokenizes C code coming from stdin (a pipe, a redirected file, a terminal) in constant
+ * memory: the input goes through a fixed ring buffer and the tokens are pulled one at a time
+ * Usage: cat file.c | streamexample
+ */
+int main(int argc, char **argv)
+{
+    ParserContext ctx = CreateParserContext(true);
+    ParsingFunction pf;
+    pf.readerFunction = ConsumeString_R;
+    AddParseRule(&ctx, "String", IsStringStart, pf);
+    pf.readerFunction = ConsumeComment_R;
+    AddParseRule(&ctx, "Comment", IsCommentStart, pf);
+    pf.readerFunction = ConsumeChar_R;
+    AddParseRule(&ctx, "Char", IsCharStart, pf);
+    pf.readerFunction = ConsumeNumber_R;
+    AddClassParseRule(&ctx, "Number", NumericClass, pf);
+    pf.readerFunction = ConsumeIdentifier_R;
+    AddClassParseRule(&ctx, "Identifier", IdentifierStartClass, pf);
+    pf.readerFunction = ConsumeSingleCharToken_R;
+    AddClassParseRule(&ctx, "Single Character token", SingleCharClass, pf);
+    pf.readerFunction = ConsumeWhiteSpace_R;
+    AddClassParseRule(&ctx, "White space muncher", WhiteSpaceClass, pf);
+    CompileRules(&ctx);
+    SetCKeywords(&ctx);
+
+    // The buffer has to hold the longest text a rule may have to go back over (a failed string
+    // or character literal for the C rules)
+    InputSource in = FileInputSource(stdin, 64 * 1024);
+    OpenReaderTokenStream(&ctx, &in);
+    Token t;
+    uint64_t count = 0;
+    while (NextToken(&ctx, &t))
+    {
+        if (count < 20)
+            printf("%ld:%ld %s '%s'\n", t.line, t.at, t.type, t.value.arr);
+        count++;
+    }
+    CloseTokenStream(&ctx);
+    printf("%lu tokens, %lu bytes read, %lu marks dropped\n", (unsigned long)count, (unsigned long)in.end,
+           (unsigned long)in.lostMarks);
+    FreeInputSource(&in);
+    FreeParserContext(&ctx);
+    return 0;
+}
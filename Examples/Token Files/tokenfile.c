@@ -0,0 +1,131 @@
+#include "../C Parser/CRules.h"
+/**
+ * @brief Tokenizes a C file once and saves the tokens in a binary token file, then reads them
+ * back the way a later stage of a pipeline would: by mapping the token file, without parsing the
+ * source again. Last the file goes through a token cache, including an entry damaged on disk
+ * Usage: tokenfile [source file] [token file]
+ */
+static void AddCRules(ParserContext *ctx)
+{
+    ParsingFunction pf;
+    pf.stringFunction = ConsumeString_S;
+    AddParseRule(ctx, "String", IsStringStart, pf);
+    pf.stringFunction = ConsumeComment_S;
+    AddParseRule(ctx, "Comment", IsCommentStart, pf);
+    pf.stringFunction = ConsumeChar_S;
+    AddParseRule(ctx, "Char", IsCharStart, pf);
+    pf.stringFunction = ConsumeNumber_S;
+    AddClassParseRule(ctx, "Number", NumericClass, pf);
+    pf.stringFunction = ConsumeIdentifier_S;
+    AddClassParseRule(ctx, "Identifier", IdentifierStartClass, pf);
+    pf.stringFunction = ConsumeSingleCharToken_S;
+    AddClassParseRule(ctx, "Single Character token", SingleCharClass, pf);
+    pf.stringFunction = ConsumeWhiteSpace_S;
+    AddClassParseRule(ctx, "White space muncher", WhiteSpaceClass, pf);
+    CompileRules(ctx);
+    SetCKeywords(ctx);
+}
+
+// Cuts the text pool of the cache's only entry in half, the records then outlast the text
+static bool CutCachedText(TokenCache *cache)
+{
+    TokenCacheEntryArray entries;
+    ListTokenCache(cache, &entries);
+    char path[4096];
+    bool found = (entries.size == 1);
+    if (found)
+        snprintf(path, sizeof(path), "%s/%s", cache->directory, entries.arr[0].name);
+    FREE_ARRAY(entries)
+    MappedFile entry;
+    if (!found || !MapFile(path, &entry))
+        return false;
+    uint64_t poolOffset = ReadLE((const uint8_t *)entry.data + 48, 8);
+    uint64_t poolSize = ReadLE((const uint8_t *)entry.data + 56, 8) / 2;
+    char *data = (char *)malloc(poolOffset + poolSize);
+    memcpy(data, entry.data, poolOffset + poolSize);
+    UnmapFile(&entry);
+    FILE *out = fopen(path, "wb");
+    if (out != NULL)
+    {
+        fwrite(data, 1, 56, out);
+        WriteLE(out, poolSize, 8);
+        fwrite(data + 64, 1, poolOffset + poolSize - 64, out);
+        fclose(out);
+    }
+    free(data);
+    return out != NULL;
+}
+
+int main(int argc, char **argv)
+{
+    char *sourcePath = (argc > 1) ? argv[1] : "../C Parser/test.c";
+    const char *tokenPath = (argc > 2) ? argv[2] : "test.tok";
+
+    ParserContext ctx = CreateParserContext(false);
+    ctx.spanTokens = true;
+    AddCRules(&ctx);
+
+    if (!ParseMappedFile(&ctx, sourcePath))
+    {
+        printf("Could not open %s\n", sourcePath);
+        return 1;
+    }
+    // The text is stored too so the reader doesn't need the source
+    if (!WriteTokenFile(&ctx, tokenPath, true))
+    {
+        printf("Could not write %s\n", tokenPath);
+        return 1;
+    }
+    printf("Wrote %lu tokens to %s\n", (unsigned long)ctx.tokens.size, tokenPath);
+    uint64_t tokenCount = ctx.tokens.size;
+    FreeParserContext(&ctx);
+
+    TokenFileReader reader;
+    if (!OpenTokenFile(&reader, tokenPath))
+    {
+        printf("%s is not a token file\n", tokenPath);
+        return 1;
+    }
+    Token t;
+    while (NextStoredToken(&reader, &t))
+        printf("[%ld,%ld]: %s: %s\n", t.line, t.at, t.type, t.value.arr);
+    // Tokens can also be read from anywhere in the file
+    if ((reader.tokenCount > 0) && SeekStoredToken(&reader, reader.tokenCount - 1) && NextStoredToken(&reader, &t))
+        printf("Last token: %s\n", t.value.arr);
+    CloseTokenFile(&reader);
+
+    // A miss stores the tokens and the next parse loads them. Once the entry's text is cut short
+    // the parse must be a miss again (the entry is replaced) with the same tokens
+    TokenCache cache;
+    if (!OpenTokenCache(&cache, "token-cache", 0))
+    {
+        printf("Could not open the token cache\n");
+        return 1;
+    }
+    for (int run = 0; run < 4; run++)
+    {
+        if ((run == 2) && !CutCachedText(&cache))
+        {
+            printf("Could not damage the cache entry\n");
+            return 1;
+        }
+        ctx = CreateParserContext(false);
+        ctx.spanTokens = true;
+        AddCRules(&ctx);
+        uint64_t misses = cache.misses;
+        if (!CachedParse(&cache, &ctx, sourcePath) || (ctx.tokens.size != tokenCount))
+        {
+            printf("Cached parse %d got %lu tokens instead of %lu\n", run, (unsigned long)ctx.tokens.size,
+                   (unsigned long)tokenCount);
+            return 1;
+        }
+        if ((run == 2) && (cache.misses == misses))
+        {
+            printf("The damaged cache entry was loaded\n");
+            return 1;
+        }
+        FreeParserContext(&ctx);
+    }
+    PrintTokenCacheStats(&cache, stdout);
+    CloseTokenCache(&cache);
+}
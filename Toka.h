@@ -14,7 +14,53 @@
 #include "stdint.h"
 #include "stdlib.h"
 #include "stdio.h"
+#include "string.h"
+#if defined(_WIN32)
+#include <windows.h>
+#include <direct.h>
+#include <sys/utime.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#define TOKA_HAS_MMAP
+#endif
+// Vectorized scans: SSE2 is used when the target has it, AVX2 is compiled in with GCC/Clang and
+// picked at runtime if the CPU supports it. Define TOKA_NO_SIMD to only use the scalar versions
+#if !defined(TOKA_NO_SIMD)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define TOKA_SIMD_SSE2
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define TOKA_SIMD_AVX2
+#endif
+#endif
+// Cycle counter used by the rule profiler
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 ////////////////////////MACROS//////////////////////
+// Every allocation of Tok-A goes through these, define them before including Toka.h to use your
+// own allocator (or to count allocations)
+#ifndef TOKA_MALLOC
+#define TOKA_MALLOC(SIZE) malloc(SIZE)
+#endif
+#ifndef TOKA_CALLOC
+#define TOKA_CALLOC(COUNT, SIZE) calloc(COUNT, SIZE)
+#endif
+#ifndef TOKA_REALLOC
+#define TOKA_REALLOC(POINTER, SIZE) realloc(POINTER, SIZE)
+#endif
+#ifndef TOKA_FREE
+#define TOKA_FREE(POINTER) free(POINTER)
+#endif
 #define ENUM_STRINGIFY(ENUM) #ENUM
 #define ARRAY(TYPE, TYPENAME)    \
     typedef struct               \
@@ -23,37 +69,37 @@
         uint64_t size, capacity; \
     } TYPENAME;
 
-#define INIT_ARRAY(TYPE, ARRAY, CAPACITY)                       \
-    {                                                           \
-        if (CAPACITY > 0)                                       \
-            ARRAY.arr = (TYPE *)calloc(CAPACITY, sizeof(TYPE)); \
-        else                                                    \
-            ARRAY.arr = NULL;                                   \
-        ARRAY.size = 0;                                         \
-        ARRAY.capacity = CAPACITY;                              \
-    }
-
-#define EXPAND_ARRAY(TYPE, ARRAY)                                                  \
-    {                                                                              \
-        if (ARRAY.capacity == 0)                                                   \
-        {                                                                          \
-            ARRAY.arr = (TYPE *)calloc(2, sizeof(TYPE));                           \
-            ARRAY.capacity = 2;                                                    \
-        }                                                                          \
-        else if ((ARRAY.size == ARRAY.capacity))                                   \
-        {                                                                          \
-            ARRAY.capacity *= 2;                                                   \
-            ARRAY.arr = (TYPE *)realloc(ARRAY.arr, sizeof(TYPE) * ARRAY.capacity); \
-        }                                                                          \
-    }
-
-#define SHRINK_ARRAY(TYPE, ARRAY)                                              \
-    {                                                                          \
-        if (ARRAY.size != 0 && (ARRAY.size != ARRAY.capacity))                 \
-        {                                                                      \
-            ARRAY.arr = (TYPE *)realloc(ARRAY.arr, sizeof(TYPE) * ARRAY.size); \
-            ARRAY.capacity = ARRAY.size;                                       \
-        }                                                                      \
+#define INIT_ARRAY(TYPE, ARRAY, CAPACITY)                            \
+    {                                                                \
+        if (CAPACITY > 0)                                            \
+            ARRAY.arr = (TYPE *)TOKA_CALLOC(CAPACITY, sizeof(TYPE)); \
+        else                                                         \
+            ARRAY.arr = NULL;                                        \
+        ARRAY.size = 0;                                              \
+        ARRAY.capacity = CAPACITY;                                   \
+    }
+
+#define EXPAND_ARRAY(TYPE, ARRAY)                                                       \
+    {                                                                                   \
+        if (ARRAY.capacity == 0)                                                        \
+        {                                                                               \
+            ARRAY.arr = (TYPE *)TOKA_CALLOC(2, sizeof(TYPE));                           \
+            ARRAY.capacity = 2;                                                         \
+        }                                                                               \
+        else if ((ARRAY.size == ARRAY.capacity))                                        \
+        {                                                                               \
+            ARRAY.capacity *= 2;                                                        \
+            ARRAY.arr = (TYPE *)TOKA_REALLOC(ARRAY.arr, sizeof(TYPE) * ARRAY.capacity); \
+        }                                                                               \
+    }
+
+#define SHRINK_ARRAY(TYPE, ARRAY)                                                   \
+    {                                                                               \
+        if (ARRAY.size != 0 && (ARRAY.size != ARRAY.capacity))                      \
+        {                                                                           \
+            ARRAY.arr = (TYPE *)TOKA_REALLOC(ARRAY.arr, sizeof(TYPE) * ARRAY.size); \
+            ARRAY.capacity = ARRAY.size;                                            \
+        }                                                                           \
     }
 
 #define APPEND_TO_ARRAY(TYPE, ARRAY, VALUE)                          \
@@ -76,19 +122,87 @@
         else                                                     \
             BOOL = false;                                        \
     }
-#define FREE_ARRAY(ARRAY)      \
-    {                          \
-        if ((ARRAY.size != 0)) \
-            free(ARRAY.arr);   \
-        ARRAY.size = 0;        \
-        ARRAY.capacity = 0;    \
-        ARRAY.arr = NULL;      \
+// Arrays with a capacity of 0 do not own their memory (e.g. values carved out of an arena)
+#define FREE_ARRAY(ARRAY)          \
+    {                              \
+        if ((ARRAY.capacity != 0)) \
+            TOKA_FREE(ARRAY.arr);  \
+        ARRAY.size = 0;            \
+        ARRAY.capacity = 0;        \
+        ARRAY.arr = NULL;          \
+    }
+#define SET_TOKEN_ENUM_TYPE(TOKEN, ENUM)           \
+    {                                              \
+        TOKEN.typeId = ENUM;                       \
+        TOKEN.type = (char *)ENUM_STRINGIFY(ENUM); \
+    }
+// Range [FIRST, END) of the rules to try for character C: every rule, or only the rules
+// whose condition accepts C if the rules are compiled
+#define RULE_CANDIDATES(CTX, C, FIRST, END)                           \
+    {                                                                 \
+        if ((CTX)->rulesCompiled)                                     \
+        {                                                             \
+            FIRST = (CTX)->ruleDispatch[(unsigned char)(C)];          \
+            END = (CTX)->ruleDispatch[(unsigned char)(C) + 1];        \
+        }                                                             \
+        else                                                          \
+        {                                                             \
+            FIRST = 0;                                                \
+            END = (CTX)->rules.size;                                  \
+        }                                                             \
+    }
+// String parsing functions that look further than the character after what they consume
+// (typically when they fail) must report the furthest position they read for Retokenize
+#define NOTE_READ(CTX, POS)                                       \
+    {                                                             \
+        if ((uint64_t)(POS) + 1 > (CTX)->furthestRead)            \
+            (CTX)->furthestRead = (uint64_t)(POS) + 1;            \
     }
-#define SET_TOKEN_ENUM_TYPE(TOKEN, ENUM)   \
-    {                                      \
-        TOKEN.typeId = ENUM;               \
-        TOKEN.type = ENUM_STRINGIFY(ENUM); \
+// True if the byte C is in the CharClass CLASS, a single bit test
+#define CHAR_CLASS_HAS(CLASS, C) ((((CLASS).bits[(unsigned char)(C) >> 6]) >> ((unsigned char)(C) & 63)) & 1)
+// Constant initializer of a CharClass from its four words (bit c % 64 of word c / 64 is byte c),
+// for classes that must be ready before any code runs. CHAR_BITS makes the words
+#define CHAR_CLASS_CONSTANT(W0, W1, W2, W3)                                \
+    {                                                                      \
+        {(uint64_t)(W0), (uint64_t)(W1), (uint64_t)(W2), (uint64_t)(W3)},  \
+        {                                                                  \
+            CHAR_NIBBLE_ROWS(W0, W1), CHAR_NIBBLE_ROWS(W2, W3)             \
+        }                                                                  \
     }
+// Bits of the bytes [FIRST, LAST] in their word, both must be in the same word
+#define CHAR_BITS(FIRST, LAST) ((~0ULL << ((FIRST) & 63)) & (~0ULL >> (63 - ((LAST) & 63))))
+// The nibbleRows of half a class (see UpdateCharClassTables) from its two words
+#define CHAR_NIBBLE_ROWS(LOW, HIGH)                                                                  \
+    {                                                                                                \
+        CHAR_NIBBLE_ROW(LOW, HIGH, 0), CHAR_NIBBLE_ROW(LOW, HIGH, 1), CHAR_NIBBLE_ROW(LOW, HIGH, 2), \
+        CHAR_NIBBLE_ROW(LOW, HIGH, 3), CHAR_NIBBLE_ROW(LOW, HIGH, 4), CHAR_NIBBLE_ROW(LOW, HIGH, 5), \
+        CHAR_NIBBLE_ROW(LOW, HIGH, 6), CHAR_NIBBLE_ROW(LOW, HIGH, 7), CHAR_NIBBLE_ROW(LOW, HIGH, 8), \
+        CHAR_NIBBLE_ROW(LOW, HIGH, 9), CHAR_NIBBLE_ROW(LOW, HIGH, 10),                               \
+        CHAR_NIBBLE_ROW(LOW, HIGH, 11), CHAR_NIBBLE_ROW(LOW, HIGH, 12),                              \
+        CHAR_NIBBLE_ROW(LOW, HIGH, 13), CHAR_NIBBLE_ROW(LOW, HIGH, 14),                              \
+        CHAR_NIBBLE_ROW(LOW, HIGH, 15)                                                               \
+    }
+// Bit H of row L is byte (H << 4) | L: the low 4 high nibbles come from LOW, the others from HIGH
+#define CHAR_NIBBLE_ROW(LOW, HIGH, L)                                                              \
+    (uint8_t)(CHAR_NIBBLE_BIT(LOW, 0, L, 0) | CHAR_NIBBLE_BIT(LOW, 16, L, 1) |                     \
+              CHAR_NIBBLE_BIT(LOW, 32, L, 2) | CHAR_NIBBLE_BIT(LOW, 48, L, 3) |                    \
+              CHAR_NIBBLE_BIT(HIGH, 0, L, 4) | CHAR_NIBBLE_BIT(HIGH, 16, L, 5) |                   \
+              CHAR_NIBBLE_BIT(HIGH, 32, L, 6) | CHAR_NIBBLE_BIT(HIGH, 48, L, 7))
+#define CHAR_NIBBLE_BIT(WORD, SHIFT, L, BIT) (((((uint64_t)(WORD)) >> ((SHIFT) + (L))) & 1) << (BIT))
+// Tests the rule's condition function, or its character class if it was added with AddClassParseRule
+#define RULE_ACCEPTS(RULE, C) \
+    (((RULE)->condition != NULL) ? (RULE)->condition(C) : (bool)CHAR_CLASS_HAS((RULE)->charClass, C))
+// Binary token files (see WriteTokenFile)
+#define TOKEN_FILE_VERSION 1
+#define TOKEN_FILE_HEADER_SIZE 64
+#define TOKEN_FILE_BLOCK 256 // Tokens between two entries of the seek index
+#define TOKEN_FILE_HAS_TEXT 1
+#define NFA_EPSILON 0
+#define NFA_SPLIT 1
+#define NFA_SET 2
+#define NFA_ACCEPT 3
+#define RULE_CANDIDATE(CTX, K) \
+    ((CTX)->rulesCompiled ? &(CTX)->rules.arr[(CTX)->ruleCandidates.arr[K]] : &(CTX)->rules.arr[K])
 ////////////////////////MACROS END//////////////////////
 
 typedef struct _ParserCTX ParserContext;
@@ -97,12 +211,39 @@ typedef struct _Token Token;
 typedef bool (*ParsingCondition)(char c);
 typedef void (*StringParsingFunction)(ParserContext *, char, char *);
 typedef void (*FileParsingFunction)(ParserContext *, char, FILE *);
+typedef struct _InputSource InputSource;
+typedef void (*ReaderParsingFunction)(ParserContext *, char, InputSource *);
 typedef union _ParsingFunction
 {
     FileParsingFunction fileFunction;     // If yes parse it as ____
     StringParsingFunction stringFunction; // If yes parse it as ____
+    ReaderParsingFunction readerFunction; // Used by ParseReader ('_R' functions)
 } ParsingFunction;
 
+/** @brief A set of bytes stored as a 256 bit bitmap
+    @note Build them with CharClassRange/CharClassSet and combine them with CharClassUnion and
+    CharClassDifference. Testing a character (InCharClass or CHAR_CLASS_HAS) is a single bit test
+*/
+typedef struct
+{
+    uint64_t bits[4];
+    // nibbleRows[h / 8][l] has bit h % 8 set if the byte (h << 4) | l is in the class, used by
+    // the vectorized scans. The CharClass functions keep it in sync with bits
+    uint8_t nibbleRows[2][16];
+} CharClass;
+
+/** @brief What a rule cost while profiling is enabled (see EnableRuleProfiling)
+    @note With compiled rules the conditions are never called, every rule the dispatch table
+    offers for a character counts as a condition hit
+*/
+typedef struct
+{
+    uint64_t conditionCalls, conditionHits; // Condition evaluations and how many returned true
+    uint64_t invocations, successes, failures; // Parsing function calls, failed ones left the cursor unchanged
+    uint64_t bytesConsumed;                    // Bytes the successful calls advanced the cursor by
+    uint64_t cycles;                           // Cycle counter ticks spent in the parsing function
+} RuleProfile;
+
 /** @brief A parsing rule determines the initial condition of parsing a specific token
     and how to parse it
     @note Each Parsing function will be responsible to restore the state of the object being
@@ -111,10 +252,13 @@ typedef union _ParsingFunction
 */
 typedef struct
 {
-    ParsingCondition condition; // Can I parse this as ___
+    ParsingCondition condition; // Can I parse this as ___ (NULL if charClass is used instead)
+    CharClass charClass;        // The characters the rule starts on when it has no condition
     ParsingFunction func;
     int id;
     char *name;
+    RuleProfile profile;
+    bool nonOverlapping; // Whenever it succeeds no other rule would have, see SetRuleNonOverlapping
 } ParsingRule;
 
 // Despite the macro's ability to create the type, write it for
@@ -137,15 +281,260 @@ typedef struct
     ParsingRule *arr;
     uint64_t size, capacity;
 } ParsingRuleArray;
+
+typedef struct
+{
+    uint16_t *arr;
+    uint64_t size, capacity;
+} RuleIndexArray;
+
+typedef struct
+{
+    uint64_t *arr;
+    uint64_t size, capacity;
+} OffsetArray;
+
+typedef struct
+{
+    uint64_t *arr;
+    uint64_t size, capacity;
+} CountArray;
 /*END OF ARRAY STRUCTS*/
 
+/** @brief Describes an edit of the source: deletedLength bytes at offset were replaced by
+    insertedLength bytes
+*/
+typedef struct
+{
+    uint64_t offset, deletedLength, insertedLength;
+} TextEdit;
+
+/** @brief A bump allocator made of a chain of blocks
+    @note Individual allocations can't be freed, ArenaReset rewinds the whole arena in O(1)
+    and keeps the blocks around to be reused
+*/
+typedef struct _ArenaBlock ArenaBlock;
+struct _ArenaBlock
+{
+    ArenaBlock *next;
+    uint64_t size, used; // The block's memory follows this header
+};
+typedef struct
+{
+    ArenaBlock *first, *current;
+    uint64_t blockSize;
+} Arena;
+
+/** @brief A whole file loaded into one contiguous, NUL terminated block of memory
+    @note If the file can be memory mapped it will be, otherwise it is read into a heap buffer
+*/
+typedef struct
+{
+    char *data;
+    uint64_t size;
+    bool mapped; // true if data is a memory mapping, false if it was malloc'd
+#if defined(_WIN32)
+    HANDLE fileHandle, mappingHandle;
+#endif
+} MappedFile;
+
+// Reads at most size bytes into buffer, returns how many it read and 0 at the end of the input
+typedef size_t (*InputReadFunction)(void *user, char *buffer, size_t size);
+#define INPUT_NO_MARK UINT64_MAX
+// Returned by Feed when the input buffer could not grow to take the bytes
+#define FEED_FAILED UINT64_MAX
+/** @brief Input that is pulled through a fixed size ring buffer by a read callback, for pipes,
+    sockets and other streams that can't be seeked or held in memory
+    @note Offsets are counted from the start of the input. Only the bytes from the mark (or the
+    last byte read if there is no mark) on are kept, so rules can go back to the mark with
+    InputRewind instead of fseek. When the marked text outgrows the buffer the mark is dropped
+*/
+struct _InputSource
+{
+    InputReadFunction read;
+    void *user;
+    char *buffer;
+    uint64_t capacity;   // Power of two, byte o of the input is buffer[o & (capacity - 1)]
+    uint64_t start, end; // The buffer holds the bytes [start, end) of the input
+    uint64_t position;   // Offset of the byte InputGet returns next
+    uint64_t mark;       // Bytes from mark on are kept, INPUT_NO_MARK if nothing is marked
+    uint64_t lostMarks;  // Marks dropped because the marked text did not fit in the buffer
+    bool ended;          // The read function returned 0 (or Finish was called on a pushed input)
+    bool starved;        // A pushed input was read past the bytes fed so far
+    uint64_t resumeAt;   // A starved pushed input is parsed again once end reaches this
+};
+
+/** @brief The type name of a typeId in TokenColumns
+*/
+typedef struct
+{
+    int typeId;
+    char *type;
+} TokenTypeName;
+
+/** @brief Tokens stored as one contiguous array per field (structure of arrays)
+    @note A pass that only looks at the types reads 4 bytes per token instead of a whole Token.
+    Lines, columns and lengths are stored on 32 bits. Use TokenColumnView to get a Token back
+*/
+typedef struct
+{
+    int32_t *typeIds;
+    uint32_t *lines, *columns; // Token.line and Token.at
+    uint64_t *offsets;         // Where the token starts in the input
+    uint32_t *lengths;
+    uint64_t *textStarts;      // Where each token's NUL terminated text starts in text (keepText only)
+    String text;
+    bool keepText;
+    TokenTypeName *typeNames; // One entry per distinct typeId
+    uint64_t typeNameCount;
+    uint64_t size, capacity;
+} TokenColumns;
+
+/** @brief Reads a token file written by WriteTokenFile straight from a memory mapping
+    @note Tokens are decoded one at a time by NextStoredToken, SeekStoredToken jumps to any
+    token through the index. Type names and texts point into the mapping
+*/
+typedef struct
+{
+    MappedFile file;
+    uint32_t version, flags, typeCount;
+    uint64_t tokenCount;
+    TokenTypeName *types;
+    const uint8_t *records, *recordsEnd, *index, *pool;
+    uint64_t poolSize;
+    // Decoding state: the next token and what its fields are relative to
+    uint64_t next, recordPos, offset, line, poolPos;
+} TokenFileReader;
+
+/** @brief A directory of token files keyed by the hash of a file's content and of the rules
+    @note See CachedParse. The statistics count the calls since OpenTokenCache
+*/
+typedef struct
+{
+    char *directory;
+    uint64_t maxBytes;  // The oldest entries are evicted when the cache grows past this, 0 for no limit
+    uint64_t bytes;     // Current size of the entries
+    uint64_t hits, misses, stores, evictions;
+    TokenTypeName *typeNames; // Type names of loaded tokens, they live as long as the cache
+    uint64_t typeNameCount;
+} TokenCache;
+
+// Directory entries of the cache, used to size it and pick what to evict
+typedef struct
+{
+    char name[48];
+    uint64_t size;
+    int64_t modified;
+} TokenCacheEntry;
+
+typedef struct
+{
+    TokenCacheEntry *arr;
+    uint64_t size, capacity;
+} TokenCacheEntryArray;
+
+/** @brief A distinct text stored by an Interner
+*/
+typedef struct
+{
+    const char *text; // NUL terminated, lives in the interner's arena
+    uint32_t length, hash;
+} Symbol;
+
+typedef struct
+{
+    Symbol *arr;
+    uint64_t size, capacity;
+} SymbolArray;
+
+/** @brief Stores every distinct text once and numbers them
+    @note Symbol ids start at 1, the text of id s is symbols.arr[s - 1]. The hash table holds
+    ids and is kept at most half full
+*/
+typedef struct
+{
+    SymbolArray symbols;
+    uint32_t *slots; // slotMask + 1 slots, 0 for empty ones
+    uint64_t slotMask;
+    Arena text;
+} Interner;
+
+/** @brief A keyword, the typeId and type name given to the tokens that spell it
+*/
+typedef struct
+{
+    const char *text;
+    int typeId;
+    const char *name;
+} Keyword;
+
+/** @brief A collision free hash table of keywords
+    @note Built once by BuildKeywordTable with a seed chosen so that no two keywords share a
+    slot, so a lookup hashes the text once and compares it against a single candidate.
+    The keyword strings are not copied and must outlive the table
+*/
+typedef struct
+{
+    Keyword *slots;         // slotMask + 1 slots, empty ones have a NULL text
+    uint32_t *slotLengths;  // Length of the keyword in each slot
+    uint32_t seed, slotMask;
+    uint64_t count, minLength, maxLength;
+} KeywordTable;
+
+/** @brief A token described by a regex-like pattern (see AddPatternRule)
+*/
+typedef struct
+{
+    const char *pattern;
+    int typeId;
+    char *type; // NULL for patterns whose matches are skipped without making a token
+} TokenPattern;
+
+typedef struct
+{
+    TokenPattern *arr;
+    uint64_t size, capacity;
+} TokenPatternArray;
+
+/** @brief The minimized DFA all the patterns of a context are compiled into
+    @note Bytes that no pattern tells apart share a column (byteClasses), state 0 is the dead
+    state. The next state of s on byte b is transitions[s * classCount + byteClasses[b]]
+*/
+typedef struct
+{
+    bool compiled;
+    uint8_t byteClasses[256];
+    uint32_t classCount, stateCount, start;
+    uint32_t *transitions;
+    int32_t *accepts; // Index of the pattern a state accepts (the first registered one), -1 if none
+} PatternLexer;
+
+/** @brief A state of the NFA patterns are parsed into before being turned into a DFA
+*/
+typedef struct
+{
+    int kind;        // NFA_EPSILON, NFA_SPLIT, NFA_SET or NFA_ACCEPT
+    int out, out2;   // Next states (out2 only for NFA_SPLIT), -1 while not connected
+    int pattern;     // Accepted pattern for NFA_ACCEPT
+    CharClass set;   // Bytes NFA_SET moves on
+} NfaState;
+
+typedef struct
+{
+    NfaState *arr;
+    uint64_t size, capacity;
+} NfaStateArray;
+
 /*CORE STRUCTS*/
 struct _Token
 {
     char *type;
     int typeId;
+    uint32_t symbol;         // Id of the token's text in ctx->interner, 0 if the context doesn't intern
     long at, line;
-    String value;
+    String value;            // Empty (arr == NULL) when the token is a span into the source
+    uint64_t offset, length; // Where the token's text lives in the source buffer
+    uint64_t priorReach;     // Furthest source position read before this token's rule started
 };
 struct _ParserCTX
 {
@@ -154,21 +543,300 @@ struct _ParserCTX
     TokenArray tokens;
     bool fileMode;
     ParsingRuleArray rules;
+    char *source;         // The buffer being parsed in string/mapped mode
+    uint64_t sourceSize;  // Number of bytes in source (excluding the NUL terminator)
+    MappedFile sourceFile; // Backing storage of source when parsing with ParseMappedFile
+    bool spanTokens;       // If true AppendToken stores only (offset, length) and no value string
+    bool useArena;         // If true token values are carved out of arena (see UseTokenArena)
+    Arena arena;
+    String scratch;        // Reusable buffer for rules that collect a token's text as they read it
+    FILE *stream;          // File being read by NextToken in file mode
+    InputSource *input;    // Input read by NextToken after OpenReaderTokenStream (not owned)
+    bool pushing;          // Set by the first Feed until Finish
+    InputSource pushInput; // The bytes given to Feed that are not tokenized yet
+    bool streaming;        // Set by Open(Mapped)TokenStream
+    uint64_t streamNext;   // Index in tokens of the next token NextToken hands out
+    uint64_t furthestRead; // One past the furthest source position the rules have read
+    uint64_t stepReach;    // furthestRead when the current rule started (see Token.priorReach)
+    KeywordTable keywords; // Keywords the rules can classify their tokens with (see SetKeywords)
+    TokenPatternArray patterns; // Added by AddPatternRule, compiled into lexer by CompilePatterns
+    PatternLexer lexer;
+    bool profiling;             // If true the parse steps fill in the profile of every rule
+    RuleProfile patternProfile; // The pattern DFA, profiled as if it was a single rule
+    // First character dispatch table built by CompileRules. The candidate rules of byte b are
+    // rules.arr[ruleCandidates.arr[k]] for k in [ruleDispatch[b], ruleDispatch[b + 1])
+    bool rulesCompiled;
+    uint32_t ruleDispatch[257];
+    RuleIndexArray ruleCandidates;
+    bool lazyPositions;      // If true line/at are computed from the offsets when asked (see UseLazyPositions)
+    OffsetArray newlines;    // Offsets of the newlines of source, built on demand
+    const char *newlinesSource;
+    uint64_t newlinesSize;   // source and sourceSize the newline index was built for
+    bool interning;          // If true token values are stored once per distinct text (see UseInterner)
+    Interner interner;
+    bool adaptiveOrdering;   // If true the candidates are reordered by how often they win
+    uint32_t *candidateWins; // Successes of ruleCandidates.arr[k], allocated by the first win
+    bool filteringTypes;     // If true only the types set in keepTypes are stored (see KeepTokenTypes)
+    uint64_t *keepTypes;     // Bit i is set if the tokens of type id i are stored
+    uint64_t keepTypeWords;
+    bool countingTypes;      // If true tokens are only counted in typeCounts (see CountTokenTypes)
+    CountArray typeCounts;   // typeCounts.arr[i] tokens of type id i were made since the last reset
+    uint64_t skippedTokens;  // Tokens the rules made that were not stored
+    bool recordingSkips;     // Set while a step on a pushed input runs, it may have to be undone
+    CountArray stepSkips;    // Type ids (as int64_t) SkipToken saw during that step
 };
 /*END OF CORE STRUCTS*/
 
 ParserContext CreateParserContext(bool parsingFiles);
 void AddParseRule(ParserContext *ctx, char *name,
                   ParsingCondition conditionFunc, ParsingFunction parseFunc);
+// Adds a rule whose condition is membership of the character in charClass
+void AddClassParseRule(ParserContext *ctx, char *name, CharClass charClass, ParsingFunction parseFunc);
+// Adds a token described by a pattern (string and mapped mode only). Returns false if the
+// pattern is invalid. type NULL means matches are consumed without making a token
+bool AddPatternRule(ParserContext *ctx, const char *pattern, int typeId, char *type);
+// Compiles the patterns into a DFA that Parse tries before the hand written rules
+void CompilePatterns(ParserContext *ctx);
+// Evaluates every rule condition for all 256 byte values so Parse can skip the condition calls
+// (and compiles the patterns)
+void CompileRules(ParserContext *ctx);
+void InvalidateCompiledRules(ParserContext *ctx);
+// Declares that whenever the rule called name succeeds no other rule would have, so the
+// adaptive ordering may try it before the others. Returns false if there is no such rule
+bool SetRuleNonOverlapping(ParserContext *ctx, const char *name, bool nonOverlapping);
+// Makes Parse move the rules that win most often to the front of their first character's candidates
+void EnableAdaptiveRuleOrdering(ParserContext *ctx, bool enable);
+void NoteRuleWin(ParserContext *ctx, char c, uint64_t k);
+// Writes the current candidate order so it can be frozen with ImportRuleOrder
+void ExportRuleOrder(const ParserContext *ctx, FILE *out);
+// Applies an order written by ExportRuleOrder, false (and nothing changed) if it does not fit the rules
+bool ImportRuleOrder(ParserContext *ctx, FILE *in);
 // Parse it as a file if fileMode is true and as a string otherwise
-void Parse(ParserContext *ctx, char *src);
+// Returns false if the file could not be opened
+bool Parse(ParserContext *ctx, char *src);
+void ParseBuffer(ParserContext *ctx);
+void ParseBufferRange(ParserContext *ctx, uint64_t end);
+void ParseBufferStep(ParserContext *ctx);
+bool ParseFileStep(ParserContext *ctx, FILE *file);
+// Versions of the steps that count what every rule does, used when ctx->profiling is set
+void ParseBufferStepProfiled(ParserContext *ctx);
+bool ParseFileStepProfiled(ParserContext *ctx, FILE *file);
+bool ParseReaderStepProfiled(ParserContext *ctx, InputSource *in);
+// Turns the per rule counters on or off, the counters are kept until ResetRuleProfiles
+void EnableRuleProfiling(ParserContext *ctx, bool enable);
+void ResetRuleProfiles(ParserContext *ctx);
+// Writes a table of the rule profiles to out
+void PrintRuleProfiles(const ParserContext *ctx, FILE *out);
+uint64_t ReadCycleCounter(void);
+// Updates the tokens of ctx after an edit turned ctx->source into newSrc, re-parsing as little as possible
+void Retokenize(ParserContext *ctx, TextEdit edit, char *newSrc, uint64_t newSize);
+// Pull interface: open a stream (same meaning of src as Parse) then call NextToken until it
+// returns false. Only the tokens of the rule being run are kept in memory
+bool OpenTokenStream(ParserContext *ctx, char *src);
+bool OpenMappedTokenStream(ParserContext *ctx, char *path);
+bool NextToken(ParserContext *ctx, Token *t);
+void CloseTokenStream(ParserContext *ctx);
+// Makes NextToken parse in with the '_R' parsing functions
+void OpenReaderTokenStream(ParserContext *ctx, InputSource *in);
+// Creates an input read by read(user, ...) through a buffer of capacity bytes (rounded up to a power of two)
+InputSource CreateInputSource(InputReadFunction read, void *user, uint64_t capacity);
+// An input reading file (stdin, a pipe opened with popen...) with fread
+InputSource FileInputSource(FILE *file, uint64_t capacity);
+size_t ReadFileInput(void *user, char *buffer, size_t size);
+void FreeInputSource(InputSource *in);
+// Next byte of the input (as an unsigned char) or EOF, like fgetc
+int InputGet(InputSource *in);
+// Reads more of the input into the buffer, false at the end of the input
+bool FillInput(InputSource *in);
+// Goes back one byte, like ungetc it does nothing when c is EOF
+void InputUnget(InputSource *in, int c);
+uint64_t InputTell(const InputSource *in);
+// Keeps the bytes from the current position on until InputRelease or the next mark
+uint64_t InputMark(InputSource *in);
+void InputRelease(InputSource *in);
+// Goes back (or forward) to offset, false if it is not in the buffer any more
+bool InputRewind(InputSource *in, uint64_t offset);
+// Runs the '_R' parsing functions over the input until it ends
+void ParseReader(ParserContext *ctx, InputSource *in);
+bool ParseReaderStep(ParserContext *ctx, InputSource *in);
+// Drops what a step that starved did (tokens, counts, positions) and goes back to mark
+void UndoStarvedStep(ParserContext *ctx, InputSource *in, uint64_t mark, uint64_t lineNumber, uint64_t charNumber, uint64_t tokenCount);
+// Makes the context store only the tokens of the types typeIds[0, count), the others are dropped
+// before their value is made. Rules can ask TokenTypeWanted to skip work on them
+void KeepTokenTypes(ParserContext *ctx, const int *typeIds, uint64_t count);
+void KeepAllTokenTypes(ParserContext *ctx);
+bool TokenTypeWanted(const ParserContext *ctx, int typeId);
+// Makes the context count the tokens of every type instead of storing them (and clears the counts)
+void CountTokenTypes(ParserContext *ctx, bool counting);
+// Tokens of type typeId counted so far, ids below 0 are only part of skippedTokens
+uint64_t TokenTypeCount(const ParserContext *ctx, int typeId);
+// Accounts for a token the rules made that is not stored
+void SkipToken(ParserContext *ctx, int typeId);
+// Push interface: give the input as it arrives with Feed (the '_R' parsing functions tokenize as
+// much of it as they can) and call Finish after the last bytes. Both return the number of new tokens,
+// Feed returns FEED_FAILED when it runs out of memory
+uint64_t Feed(ParserContext *ctx, const char *bytes, uint64_t length);
+uint64_t Finish(ParserContext *ctx);
+// Copies as much of bytes[0, length) into a pushed input as fits, growing the buffer if the marked text fills it
+uint64_t PushInput(InputSource *in, const char *bytes, uint64_t length);
+bool GrowInputSource(InputSource *in);
+// Map the file at path into memory and parse it using the string parsing functions
+bool ParseMappedFile(ParserContext *ctx, char *path);
+bool MapFile(const char *path, MappedFile *file);
+void UnmapFile(MappedFile *file);
+// Adds a token whose text is source[offset, offset + length)
+void AppendToken(ParserContext *ctx, Token t, uint64_t offset, uint64_t length);
+// Adds a token whose text is a copy of text[0, length), offset is where it starts in the input
+void AppendTokenText(ParserContext *ctx, Token t, uint64_t offset, const char *text, uint64_t length);
+// Gives the token a NUL terminated copy of text[0, length) as its value
+void SetTokenValue(ParserContext *ctx, Token *t, const char *text, uint64_t length);
+// Pointer to the token's text (not NUL terminated for span tokens, use t->length)
+char *TokenText(ParserContext *ctx, Token *t);
+// Gives a span token its own NUL terminated value and returns it
+char *MaterializeToken(ParserContext *ctx, Token *t);
+// Creates an empty column store, keepText makes it keep a copy of every token's text
+TokenColumns CreateTokenColumns(bool keepText);
+// Appends the fields of t (a token of ctx) to the columns
+void AppendTokenColumn(TokenColumns *columns, ParserContext *ctx, Token *t);
+// Appends every token of ctx to the columns
+void TokensToColumns(ParserContext *ctx, TokenColumns *columns);
+bool ReserveTokenColumns(TokenColumns *columns, uint64_t capacity);
+// Parses src (same meaning as in Parse) straight into the columns through the token stream,
+// so the Token structs never pile up in ctx->tokens
+bool ParseToColumns(ParserContext *ctx, char *src, TokenColumns *columns);
+// The token i as a Token, its value (keepText only) points into the columns and is not owned
+Token TokenColumnView(const TokenColumns *columns, uint64_t i);
+// The type name of typeId, NULL if no token of that type was stored
+char *TokenColumnType(const TokenColumns *columns, int typeId);
+uint64_t CountTokenType(const TokenColumns *columns, int typeId);
+void FreeTokenColumns(TokenColumns *columns);
+// Writes the tokens of ctx to a binary token file, withText also stores every token's text
+bool WriteTokenFile(ParserContext *ctx, const char *path, bool withText);
+// Maps a token file, false if it is missing, truncated or of another version
+bool OpenTokenFile(TokenFileReader *reader, const char *path);
+// Decodes the next token, its value points into the file's text (if it has any) and is not owned
+bool NextStoredToken(TokenFileReader *reader, Token *t);
+// Makes token index the next one NextStoredToken decodes
+bool SeekStoredToken(TokenFileReader *reader, uint64_t index);
+void CloseTokenFile(TokenFileReader *reader);
+// Opens (creating it if needed) a token cache in directory holding at most maxBytes (0: no limit)
+bool OpenTokenCache(TokenCache *cache, const char *directory, uint64_t maxBytes);
+// Like ParseMappedFile (or Parse in file mode) on the file at path, but the tokens are loaded
+// from the cache if the same content was parsed with the same rules before
+bool CachedParse(TokenCache *cache, ParserContext *ctx, char *path);
+// Identifies the rules, patterns and keywords of a context, part of the cache key
+uint64_t RuleFingerprint(const ParserContext *ctx);
+uint64_t HashBytes(const void *data, uint64_t size, uint64_t seed);
+void PrintTokenCacheStats(const TokenCache *cache, FILE *out);
+void CloseTokenCache(TokenCache *cache);
+bool LoadCachedTokens(TokenCache *cache, ParserContext *ctx, const char *path);
+void EvictTokenCache(TokenCache *cache);
+bool IsTokenCacheEntry(const char *name);
+void ListTokenCache(const TokenCache *cache, TokenCacheEntryArray *entries);
+char *CachedTypeName(TokenCache *cache, int typeId, const char *type);
+void WriteVarint(FILE *out, uint64_t value);
+bool ReadVarint(const uint8_t **p, const uint8_t *end, uint64_t *value);
+void WriteLE(FILE *out, uint64_t value, int bytes);
+uint64_t ReadLE(const uint8_t *p, int bytes);
+// Makes the tokens of the context share one copy of every distinct text and get its symbol id
+void UseInterner(ParserContext *ctx);
+Interner CreateInterner(void);
+// Id of text[0, length), added to the interner if it is new
+uint32_t InternText(Interner *interner, const char *text, uint64_t length);
+// Id of text[0, length) if it was interned before, 0 otherwise
+uint32_t FindSymbol(const Interner *interner, const char *text, uint64_t length);
+const char *SymbolText(const Interner *interner, uint32_t symbol);
+uint32_t SymbolLength(const Interner *interner, uint32_t symbol);
+void FreeInterner(Interner *interner);
+bool GrowInterner(Interner *interner);
+// Makes the context allocate token values from an arena so resetting it is O(1)
+void UseTokenArena(ParserContext *ctx, uint64_t blockSize);
+// Creates a context with the same settings and a copy of the rules of src but no tokens
+ParserContext CloneParserContext(const ParserContext *src);
 void ResetContext(bool resetRules, ParserContext *ctx);
 void FreeParserContext(ParserContext *ctx);
+// Replaces the keywords of the context, a copy of keywords[0, count) is made. Returns false (and
+// leaves the context without keywords) if two keywords are equal or the table can't be allocated
+bool SetKeywords(ParserContext *ctx, const Keyword *keywords, uint64_t count);
+// Gives t the type of the keyword spelled by text[0, length), false if it is not a keyword
+bool ClassifyKeyword(const KeywordTable *table, Token *t, const char *text, uint64_t length);
+
+Arena CreateArena(uint64_t blockSize);
+void *ArenaAlloc(Arena *arena, uint64_t size);
+void ArenaReset(Arena *arena);
+void FreeArena(Arena *arena);
+
+CharClass CharClassRange(char first, char last);
+// The class of the characters of the NUL terminated string chars
+CharClass CharClassSet(const char *chars);
+CharClass CharClassUnion(CharClass a, CharClass b);
+// The characters of a that are not in b
+CharClass CharClassDifference(CharClass a, CharClass b);
+// The class of the characters accepted by a (pure) condition function
+CharClass CharClassFromCondition(ParsingCondition condition);
+bool InCharClass(const CharClass *charClass, char c);
+// Rebuilds the tables of the vectorized scans after changing charClass->bits by hand
+void UpdateCharClassTables(CharClass *charClass);
+
+// Scanning helpers for string parsing functions. They look at buffer[pos, end) and return end
+// when they don't find what they are looking for
+// 0 for the scalar scans, 1 for SSE2 and 2 for AVX2
+int SimdLevel(void);
+// Position of the first character that is not in charClass
+uint64_t SkipCharClass(const char *buffer, uint64_t pos, uint64_t end, const CharClass *charClass);
+// Position of the first character equal to one of set[0, setSize), setSize is between 1 and 4
+uint64_t FindFirstOf(const char *buffer, uint64_t pos, uint64_t end, const char *set, int setSize);
+uint64_t CountNewlines(const char *buffer, uint64_t pos, uint64_t end);
+// Writes the offsets of the newlines of buffer[pos, end) to offsets, which needs room for all of them
+uint64_t FindNewlines(const char *buffer, uint64_t pos, uint64_t end, uint64_t *offsets);
+#if defined(TOKA_SIMD_AVX2)
+__attribute__((target("avx2"))) uint32_t CharClassMissMaskAVX2(__m256i v, __m256i rowsLow, __m256i rowsHigh,
+                                                              __m256i rowBits);
+__attribute__((target("avx2"))) uint64_t SkipCharClassAVX2(const char *buffer, uint64_t pos, uint64_t end,
+                                                          const CharClass *charClass);
+__attribute__((target("avx2"))) uint64_t FindFirstOfAVX2(const char *buffer, uint64_t pos, uint64_t end,
+                                                        const char *set, int setSize);
+__attribute__((target("avx2"))) uint64_t CountNewlinesAVX2(const char *buffer, uint64_t *pos, uint64_t end);
+__attribute__((target("avx2"))) uint64_t FindNewlinesAVX2(const char *buffer, uint64_t *pos, uint64_t end,
+                                                         uint64_t *offsets);
+#endif
+// Makes the rules and the patterns skip the line and character bookkeeping (string mode only),
+// token positions then come from TokenLine/TokenColumn or ResolveTokenPositions
+void UseLazyPositions(ParserContext *ctx, bool lazy);
+// Builds the offsets of the newlines of ctx->source, done automatically when positions are asked for
+void BuildNewlineIndex(ParserContext *ctx);
+// The line and character number of the byte at offset in ctx->source
+void OffsetPosition(ParserContext *ctx, uint64_t offset, long *line, long *at);
+long TokenLine(ParserContext *ctx, Token *t);
+long TokenColumn(ParserContext *ctx, Token *t);
+// Fills in the line and at of every token from the newline index
+void ResolveTokenPositions(ParserContext *ctx);
+
+bool BuildKeywordTable(KeywordTable *table, const Keyword *keywords, uint64_t count);
+const Keyword *FindKeyword(const KeywordTable *table, const char *text, uint64_t length);
+void FreeKeywordTable(KeywordTable *table);
+
+// Longest match of the patterns at the cursor, false if none matches
+bool MatchPatterns(ParserContext *ctx);
+void FreePatternLexer(PatternLexer *lexer);
+int NewNfaState(NfaStateArray *nfa, int kind);
+bool ParsePatternAlternation(const char **p, NfaStateArray *nfa, int *start, int *end);
+bool ParsePatternSequence(const char **p, NfaStateArray *nfa, int *start, int *end);
+bool ParsePatternRepeat(const char **p, NfaStateArray *nfa, int *start, int *end);
+bool ParsePatternAtom(const char **p, NfaStateArray *nfa, int *start, int *end);
+bool ParsePatternEscape(const char **p, CharClass *set);
+bool ParsePatternClass(const char **p, CharClass *set);
+bool ParsePattern(const char *pattern, NfaStateArray *nfa, int *start, int *end);
+void NfaClosure(const NfaStateArray *nfa, int state, uint8_t *members, int *list, int *count);
+uint32_t CountTrailingZeros(uint32_t mask);
+uint32_t CountBits(uint32_t mask);
+uint32_t HashKeyword(uint32_t seed, const char *text, uint64_t length);
 
 //////////////FUNCTION IMPLEMENTATIONS///////////////////
 ParserContext CreateParserContext(bool fileMode)
 {
     ParserContext ctx;
+    memset(&ctx, 0, sizeof(ParserContext));
     ctx.fileMode = fileMode;
     INIT_ARRAY(ParsingRule, ctx.rules, 0);
     INIT_ARRAY(Token, ctx.tokens, 0);
@@ -185,85 +853,4122 @@ inline void AddParseRule(ParserContext *ctx, char *name,
     rule.name = name;
     rule.id = ctx->rules.size + 1;
     rule.condition = conditionFunc;
+    memset(&rule.charClass, 0, sizeof(CharClass));
+    memset(&rule.profile, 0, sizeof(RuleProfile));
+    rule.nonOverlapping = false;
     rule.func = parseFunc;
     APPEND_TO_ARRAY(ParsingRule, ctx->rules, rule)
+    InvalidateCompiledRules(ctx);
+}
+
+inline void AddClassParseRule(ParserContext *ctx, char *name, CharClass charClass, ParsingFunction parseFunc)
+{
+    AddParseRule(ctx, name, NULL, parseFunc);
+    ctx->rules.arr[ctx->rules.size - 1].charClass = charClass;
+}
+
+inline bool AddPatternRule(ParserContext *ctx, const char *pattern, int typeId, char *type)
+{
+    // Only checks the syntax, the NFA gets rebuilt with all the patterns by CompilePatterns
+    NfaStateArray nfa;
+    INIT_ARRAY(NfaState, nfa, 0);
+    int start, end;
+    bool valid = ParsePattern(pattern, &nfa, &start, &end);
+    FREE_ARRAY(nfa)
+    if (!valid)
+        return false;
+    TokenPattern tokenPattern;
+    tokenPattern.pattern = pattern;
+    tokenPattern.typeId = typeId;
+    tokenPattern.type = type;
+    APPEND_TO_ARRAY(TokenPattern, ctx->patterns, tokenPattern)
+    FreePatternLexer(&ctx->lexer);
+    return true;
+}
+
+/** @brief Builds the first character dispatch table of the context's rules
+    @note Only valid if every condition is a pure function of its character. The table is
+    dropped when a rule is added, after which Parse goes back to testing every condition
+    until CompileRules is called again
+*/
+inline void CompileRules(ParserContext *ctx)
+{
+    InvalidateCompiledRules(ctx);
+    for (int b = 0; b < 256; b++)
+    {
+        ctx->ruleDispatch[b] = ctx->ruleCandidates.size;
+        for (uint64_t i = 0; i < ctx->rules.size; i++)
+        {
+            if (RULE_ACCEPTS(&ctx->rules.arr[i], (char)b))
+                APPEND_TO_ARRAY(uint16_t, ctx->ruleCandidates, (uint16_t)i)
+        }
+    }
+    ctx->ruleDispatch[256] = ctx->ruleCandidates.size;
+    ctx->rulesCompiled = true;
+    if ((ctx->patterns.size > 0) && !ctx->lexer.compiled)
+        CompilePatterns(ctx);
+}
+
+inline void InvalidateCompiledRules(ParserContext *ctx)
+{
+    FREE_ARRAY(ctx->ruleCandidates)
+    TOKA_FREE(ctx->candidateWins);
+    ctx->candidateWins = NULL;
+    ctx->rulesCompiled = false;
+}
+
+inline bool SetRuleNonOverlapping(ParserContext *ctx, const char *name, bool nonOverlapping)
+{
+    bool found = false;
+    for (uint64_t i = 0; i < ctx->rules.size; i++)
+    {
+        if ((ctx->rules.arr[i].name != NULL) && (strcmp(ctx->rules.arr[i].name, name) == 0))
+        {
+            ctx->rules.arr[i].nonOverlapping = nonOverlapping;
+            found = true;
+        }
+    }
+    return found;
+}
+
+/** @brief Turns the adaptive candidate ordering on or off (compiling the rules if needed)
+    @note A rule only overtakes its neighbour if one of the two is declared non overlapping,
+    rules that may compete for the same text keep their declared order, so the tokens are the
+    same as with the declared order. The learned order stays when it is turned off
+*/
+inline void EnableAdaptiveRuleOrdering(ParserContext *ctx, bool enable)
+{
+    if (enable && !ctx->rulesCompiled)
+        CompileRules(ctx);
+    ctx->adaptiveOrdering = enable;
+}
+
+/** @brief Counts a success of the candidate k of c and moves it one place to the front if it
+    now wins more often than the candidate before it
+    @note Repeated adjacent swaps converge to the candidates sorted by wins while keeping every
+    step O(1). Counters are halved when they saturate so recent behaviour keeps mattering
+*/
+inline void NoteRuleWin(ParserContext *ctx, char c, uint64_t k)
+{
+    if (!ctx->rulesCompiled)
+        return;
+    if (ctx->candidateWins == NULL)
+    {
+        ctx->candidateWins = (uint32_t *)TOKA_CALLOC(ctx->ruleCandidates.size + 1, sizeof(uint32_t));
+        if (ctx->candidateWins == NULL)
+            return;
+    }
+    uint32_t *wins = ctx->candidateWins;
+    uint64_t first = ctx->ruleDispatch[(unsigned char)c];
+    if (++wins[k] == UINT32_MAX)
+    {
+        for (uint64_t i = first; i < ctx->ruleDispatch[(unsigned char)c + 1]; i++)
+            wins[i] >>= 1;
+    }
+    if ((k > first) && (wins[k] > wins[k - 1]))
+    {
+        uint16_t *candidates = ctx->ruleCandidates.arr;
+        if (ctx->rules.arr[candidates[k]].nonOverlapping || ctx->rules.arr[candidates[k - 1]].nonOverlapping)
+        {
+            uint16_t rule = candidates[k];
+            candidates[k] = candidates[k - 1];
+            candidates[k - 1] = rule;
+            uint32_t count = wins[k];
+            wins[k] = wins[k - 1];
+            wins[k - 1] = count;
+        }
+    }
+}
+
+/** @brief Writes a line "byte: rule indices in the order they are tried" for every byte with
+    more than one candidate
+*/
+inline void ExportRuleOrder(const ParserContext *ctx, FILE *out)
+{
+    if (!ctx->rulesCompiled)
+        return;
+    for (int b = 0; b < 256; b++)
+    {
+        if (ctx->ruleDispatch[b + 1] - ctx->ruleDispatch[b] < 2)
+            continue;
+        fprintf(out, "%d:", b);
+        for (uint32_t k = ctx->ruleDispatch[b]; k < ctx->ruleDispatch[b + 1]; k++)
+            fprintf(out, " %u", (unsigned)ctx->ruleCandidates.arr[k]);
+        fprintf(out, "\n");
+    }
+}
+
+/** @brief Reads the lines written by ExportRuleOrder and reorders the candidates to match
+    @note Every line must be "byte:" followed by exactly the candidates of its byte, and rules
+    that are not declared non overlapping must keep their declared relative order, otherwise
+    the parse results could change and nothing is applied. Compiles the rules if needed
+*/
+inline bool ImportRuleOrder(ParserContext *ctx, FILE *in)
+{
+    if (!ctx->rulesCompiled)
+        CompileRules(ctx);
+    uint64_t candidateCount = ctx->ruleCandidates.size;
+    uint16_t *order = (uint16_t *)TOKA_MALLOC((candidateCount + 1) * sizeof(uint16_t));
+    if (order == NULL)
+        return false;
+    if (candidateCount > 0)
+        memcpy(order, ctx->ruleCandidates.arr, candidateCount * sizeof(uint16_t));
+    bool valid = true;
+    // A line holds a byte and at most a few hundred rule indices
+    char line[4096];
+    while (valid && (fgets(line, sizeof(line), in) != NULL))
+    {
+        size_t length = strlen(line);
+        if ((length + 1 == sizeof(line)) && (line[length - 1] != '\n'))
+        {
+            valid = false;
+            break;
+        }
+        char *p = line;
+        while ((*p == ' ') || (*p == '\t') || (*p == '\r') || (*p == '\n'))
+            p++;
+        if (*p == '\0')
+            continue;
+        if ((*p < '0') || (*p > '9'))
+        {
+            valid = false;
+            break;
+        }
+        unsigned long b = strtoul(p, &p, 10);
+        if ((b > 255) || (*p != ':'))
+        {
+            valid = false;
+            break;
+        }
+        p++;
+        uint32_t first = ctx->ruleDispatch[b], end = ctx->ruleDispatch[b + 1];
+        for (uint32_t k = first; valid && (k < end); k++)
+        {
+            while ((*p == ' ') || (*p == '\t'))
+                p++;
+            valid = (*p >= '0') && (*p <= '9');
+            unsigned long rule = valid ? strtoul(p, &p, 10) : 0;
+            valid = valid && (rule < ctx->rules.size);
+            order[k] = (uint16_t)rule;
+        }
+        // Nothing may follow the candidates
+        while ((*p == ' ') || (*p == '\t') || (*p == '\r') || (*p == '\n'))
+            p++;
+        valid = valid && (*p == '\0');
+        // Same set of rules, and the overlapping ones in increasing (declaration) order
+        int lastOverlapping = -1;
+        for (uint32_t k = first; valid && (k < end); k++)
+        {
+            bool listed = false;
+            for (uint32_t j = first; j < end; j++)
+                listed |= (ctx->ruleCandidates.arr[j] == order[k]);
+            for (uint32_t j = first; j < k; j++)
+                listed &= (order[j] != order[k]);
+            valid = listed;
+            if (valid && !ctx->rules.arr[order[k]].nonOverlapping)
+            {
+                valid = ((int)order[k] > lastOverlapping);
+                lastOverlapping = order[k];
+            }
+        }
+    }
+    if (valid)
+    {
+        if (candidateCount > 0)
+            memcpy(ctx->ruleCandidates.arr, order, candidateCount * sizeof(uint16_t));
+        TOKA_FREE(ctx->candidateWins);
+        ctx->candidateWins = NULL;
+    }
+    TOKA_FREE(order);
+    return valid;
 }
 
 /** @todo Condense this to eliminate code duplication */
-inline void Parse(ParserContext *ctx, char *src)
+inline bool Parse(ParserContext *ctx, char *src)
 {
     if (ctx->fileMode)
     {
         FILE *file = fopen(src, "r");
-        char c = fgetc(file);
-        while (c != EOF)
+        if (file == NULL)
+            return false;
+        while (ParseFileStep(ctx, file))
+            ;
+        fclose(file);
+    }
+    else
+    {
+        // The caller may have rewritten the same buffer, so the size is always recomputed
+        ctx->source = src;
+        ctx->sourceSize = strlen(src);
+        ParseBuffer(ctx);
+    }
+    return true;
+}
+
+// Reads the next character of the file and tries the rules on it, false at the end of the file
+inline bool ParseFileStep(ParserContext *ctx, FILE *file)
+{
+    if (ctx->profiling)
+        return ParseFileStepProfiled(ctx, file);
+    char c = fgetc(file);
+    if (c == EOF)
+        return false;
+    ctx->cursorOffset = ftell(file);
+    uint64_t first, end;
+    RULE_CANDIDATES(ctx, c, first, end)
+    for (uint64_t k = first; k < end; k++)
+    {
+        ParsingRule *rule = RULE_CANDIDATE(ctx, k);
+        if (ctx->rulesCompiled || RULE_ACCEPTS(rule, c))
         {
-            ctx->cursorOffset = ftell(file);
-            for (int i = 0; i < ctx->rules.size; i++)
+            long cursorPos = ctx->cursorOffset;
+            rule->func.fileFunction(ctx, c, file);
+            if (ctx->cursorOffset != cursorPos)
             {
-                if (ctx->rules.arr[i].condition(c))
-                {
-                    long cursorPos = ctx->cursorOffset;
-                    ctx->rules.arr[i].func.fileFunction(ctx, c, file);
-                    if (ctx->cursorOffset != cursorPos)
-                    {
-                        break;
-                    }
-                }
+                if (ctx->adaptiveOrdering)
+                    NoteRuleWin(ctx, c, k);
+                break;
             }
-            c = fgetc(file);
         }
-        fclose(file);
+    }
+    return true;
+}
+
+/** @brief Re-tokenizes only the part of the source affected by an edit
+    @note ctx->tokens must be the tokens of the previous source (string or mapped mode). Parsing
+    restarts at the last token before the edit whose preceding rules never read as far as the
+    edit, and stops as soon as it reaches an offset where a previous token started after the edit.
+    From there on the old tokens are kept with their offsets, lines and characters shifted.
+    This relies on rules only reading forward from the cursor and reporting reads past the
+    character after their token with NOTE_READ. newSrc must stay alive as long as span tokens
+    refer to it
+*/
+inline void Retokenize(ParserContext *ctx, TextEdit edit, char *newSrc, uint64_t newSize)
+{
+    // The newlines moved, the index is rebuilt when positions are asked for again
+    FREE_ARRAY(ctx->newlines)
+    TokenArray old = ctx->tokens;
+    uint64_t editEnd = edit.offset + edit.deletedLength;
+    uint64_t newEditEnd = edit.offset + edit.insertedLength;
+    long delta = (long)edit.insertedLength - (long)edit.deletedLength;
+    // Both the offsets and the prior reaches are sorted, binary search the restart token
+    uint64_t low = 0, high = old.size;
+    while (low < high)
+    {
+        uint64_t mid = (low + high) / 2;
+        if ((old.arr[mid].offset < edit.offset) && (old.arr[mid].priorReach <= edit.offset))
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    uint64_t oldFinalCursor = ctx->cursorOffset, oldFinalReach = ctx->furthestRead;
+    long oldFinalLine = ctx->lineNumber, oldFinalChar = ctx->charNumber;
+    uint64_t restart = (low > 0) ? low - 1 : 0;
+    if ((old.size > 0) && (restart < old.size) && (old.arr[restart].offset < edit.offset) &&
+        (old.arr[restart].priorReach <= edit.offset))
+    {
+        ctx->cursorOffset = old.arr[restart].offset;
+        ctx->lineNumber = old.arr[restart].line;
+        ctx->charNumber = old.arr[restart].at;
+        ctx->furthestRead = old.arr[restart].priorReach;
     }
     else
     {
-        while (src[ctx->cursorOffset] != '\0')
+        restart = 0;
+        ctx->cursorOffset = 0;
+        ctx->lineNumber = 1;
+        ctx->charNumber = 1;
+        ctx->furthestRead = 0;
+    }
+    // The re-parsed tokens are collected on their own and spliced into the old array at the end
+    INIT_ARRAY(Token, ctx->tokens, 16);
+    ctx->source = newSrc;
+    ctx->sourceSize = newSize;
+
+    uint64_t k = restart;
+    bool synced = false;
+    while ((uint64_t)ctx->cursorOffset < newSize)
+    {
+        if ((uint64_t)ctx->cursorOffset >= newEditEnd)
         {
-            for (int i = 0; i < ctx->rules.size; i++)
+            uint64_t oldPos = ctx->cursorOffset - delta;
+            while ((k < old.size) && (old.arr[k].offset < oldPos))
+                k++;
+            if ((k < old.size) && (old.arr[k].offset == oldPos))
             {
-                char c = src[ctx->cursorOffset];
-                if (ctx->rules.arr[i].condition(c))
-                {
-                    long cursorPos = ctx->cursorOffset;
-                    ctx->rules.arr[i].func.stringFunction(ctx, c, src);
-                    // If parsing succeeded add token, else continue testing
-                    if (ctx->cursorOffset != cursorPos)
-                    {
-                        break;
-                    }
-                }
+                synced = true;
+                break;
             }
         }
+        ParseBufferStep(ctx);
+    }
+    for (uint64_t i = restart; i < (synced ? k : old.size); i++)
+    {
+        if (!ctx->useArena)
+            FREE_ARRAY(old.arr[i].value)
+    }
+    TokenArray relexed = ctx->tokens;
+    uint64_t tail = synced ? old.size - k : 0;
+    uint64_t size = restart + relexed.size + tail;
+    if (size > old.capacity)
+    {
+        old.arr = (Token *)TOKA_REALLOC(old.arr, size * sizeof(Token));
+        old.capacity = size;
+    }
+    uint64_t syncIndex = restart + relexed.size;
+    memmove(old.arr + syncIndex, old.arr + k, tail * sizeof(Token));
+    if (relexed.size > 0)
+        memcpy(old.arr + restart, relexed.arr, relexed.size * sizeof(Token));
+    old.size = size;
+    FREE_ARRAY(relexed)
+    ctx->tokens = old;
+    if (synced)
+    {
+        Token *sync = &old.arr[syncIndex];
+        long syncLine = sync->line;
+        long lineDelta = (long)ctx->lineNumber - syncLine;
+        long charDelta = (long)ctx->charNumber - sync->at;
+        uint64_t reachAtSync = ctx->furthestRead;
+        for (Token *t = sync; t < old.arr + size; t++)
+        {
+            t->offset += delta;
+            if (t->line == syncLine)
+                t->at += charDelta;
+            t->line += lineDelta;
+            // Reaches inside the edited range are moved to its end
+            if (t->priorReach >= editEnd)
+                t->priorReach += delta;
+            else if (t->priorReach > edit.offset)
+                t->priorReach = newEditEnd;
+            if (t->priorReach < reachAtSync)
+                t->priorReach = reachAtSync;
+        }
+        ctx->cursorOffset = oldFinalCursor + delta;
+        ctx->charNumber = oldFinalChar + ((oldFinalLine == syncLine) ? charDelta : 0);
+        ctx->lineNumber = oldFinalLine + lineDelta;
+        if (oldFinalReach + delta > ctx->furthestRead)
+            ctx->furthestRead = oldFinalReach + delta;
     }
 }
 
-inline void ResetContext(bool resetRules, ParserContext *ctx)
+inline bool OpenTokenStream(ParserContext *ctx, char *src)
 {
-    for (int i = 0; i < ctx->tokens.size; i++)
+    CloseTokenStream(ctx);
+    if (ctx->fileMode)
     {
-        FREE_ARRAY(ctx->tokens.arr[i].value)
+        ctx->stream = fopen(src, "r");
+        if (ctx->stream == NULL)
+            return false;
     }
-    FREE_ARRAY(ctx->tokens)
-    INIT_ARRAY(Token, ctx->tokens, 0);
-    if (resetRules)
+    else
     {
-        FREE_ARRAY(ctx->rules)
-        INIT_ARRAY(ParsingRule, ctx->rules, 0);
+        ctx->source = src;
+        ctx->sourceSize = strlen(src);
     }
+    // A new stream starts at the top, whatever the context parsed before
     ctx->cursorOffset = 0;
     ctx->lineNumber = 1;
     ctx->charNumber = 1;
+    ctx->streaming = true;
+    return true;
 }
 
-inline void FreeParserContext(ParserContext *ctx)
+inline bool OpenMappedTokenStream(ParserContext *ctx, char *path)
 {
-    FREE_ARRAY(ctx->rules)
-    for (int i = 0; i < ctx->tokens.size; i++)
+    CloseTokenStream(ctx);
+    UnmapFile(&ctx->sourceFile);
+    if (!MapFile(path, &ctx->sourceFile))
+        return false;
+    ctx->source = ctx->sourceFile.data;
+    ctx->sourceSize = ctx->sourceFile.size;
+    ctx->cursorOffset = 0;
+    ctx->lineNumber = 1;
+    ctx->charNumber = 1;
+    ctx->streaming = true;
+    return true;
+}
+
+/** @brief Hands out the next token of the stream opened with Open(Mapped)TokenStream
+    @note The token (and its value) is only valid until the next call, copy it if you need
+    to keep it. Span tokens stay valid as long as the source does
+    @return false once the input is exhausted
+*/
+inline bool NextToken(ParserContext *ctx, Token *t)
+{
+    if (ctx->streamNext >= ctx->tokens.size)
     {
-        FREE_ARRAY(ctx->tokens.arr[i].value)
+        // Everything handed out so far is dropped before parsing more
+        if (ctx->useArena)
+            ArenaReset(&ctx->arena);
+        else
+        {
+            for (uint64_t i = 0; i < ctx->tokens.size; i++)
+            {
+                FREE_ARRAY(ctx->tokens.arr[i].value)
+            }
+        }
+        ctx->tokens.size = 0;
+        ctx->streamNext = 0;
+        if (!ctx->streaming)
+            return false;
+        while (ctx->tokens.size == 0)
+        {
+            if (ctx->input != NULL)
+            {
+                if (!ParseReaderStep(ctx, ctx->input))
+                    break;
+            }
+            else if (ctx->fileMode)
+            {
+                if (!ParseFileStep(ctx, ctx->stream))
+                    break;
+            }
+            else
+            {
+                if ((uint64_t)ctx->cursorOffset >= ctx->sourceSize)
+                    break;
+                ParseBufferStep(ctx);
+            }
+        }
+        if (ctx->tokens.size == 0)
+            return false;
     }
-    FREE_ARRAY(ctx->tokens)
+    *t = ctx->tokens.arr[ctx->streamNext++];
+    return true;
+}
+
+inline void CloseTokenStream(ParserContext *ctx)
+{
+    if (ctx->stream != NULL)
+        fclose(ctx->stream);
+    ctx->stream = NULL;
+    if (ctx->input != NULL)
+        InputRelease(ctx->input);
+    ctx->input = NULL;
+    ctx->streaming = false;
+}
+
+inline void OpenReaderTokenStream(ParserContext *ctx, InputSource *in)
+{
+    CloseTokenStream(ctx);
+    ctx->input = in;
+    ctx->streaming = true;
+}
+
+inline InputSource CreateInputSource(InputReadFunction read, void *user, uint64_t capacity)
+{
+    InputSource in;
+    memset(&in, 0, sizeof(InputSource));
+    in.read = read;
+    in.user = user;
+    in.capacity = 16;
+    while (in.capacity < capacity)
+        in.capacity *= 2;
+    in.buffer = (char *)TOKA_MALLOC(in.capacity);
+    in.mark = INPUT_NO_MARK;
+    return in;
+}
+
+inline size_t ReadFileInput(void *user, char *buffer, size_t size)
+{
+    return fread(buffer, 1, size, (FILE *)user);
+}
+
+/** @brief An input for a FILE that may not be seekable
+    @note fread waits until the buffer is full or the file ends, give an input fed by a pipe that
+    should be tokenized as it arrives a read function that returns what is available instead
+*/
+inline InputSource FileInputSource(FILE *file, uint64_t capacity)
+{
+    return CreateInputSource(ReadFileInput, file, capacity);
+}
+
+inline void FreeInputSource(InputSource *in)
+{
+    TOKA_FREE(in->buffer);
+    in->buffer = NULL;
+    in->capacity = 0;
+}
+
+inline int InputGet(InputSource *in)
+{
+    if ((in->position == in->end) && !FillInput(in))
+        return EOF;
+    return (unsigned char)in->buffer[in->position++ & (in->capacity - 1)];
+}
+
+inline bool FillInput(InputSource *in)
+{
+    if (in->ended)
+        return false;
+    // Pushed inputs only get more bytes from Feed
+    if (in->read == NULL)
+    {
+        in->starved = true;
+        return false;
+    }
+    // The byte before the position stays for InputUnget
+    uint64_t keep = (in->position > in->start) ? in->position - 1 : in->position;
+    if ((in->mark != INPUT_NO_MARK) && (in->mark < keep))
+    {
+        if (in->end - in->mark < in->capacity)
+            keep = in->mark;
+        else
+        {
+            in->mark = INPUT_NO_MARK;
+            in->lostMarks++;
+        }
+    }
+    in->start = keep;
+    // Reads into the free part of the ring up to where it wraps around
+    uint64_t index = in->end & (in->capacity - 1);
+    uint64_t space = in->capacity - (in->end - in->start);
+    if (space > in->capacity - index)
+        space = in->capacity - index;
+    size_t got = in->read(in->user, in->buffer + index, space);
+    if (got == 0)
+    {
+        in->ended = true;
+        return false;
+    }
+    in->end += got;
+    return true;
+}
+
+inline void InputUnget(InputSource *in, int c)
+{
+    if ((c != EOF) && (in->position > in->start))
+        in->position--;
+}
+
+inline uint64_t InputTell(const InputSource *in)
+{
+    return in->position;
+}
+
+inline uint64_t InputMark(InputSource *in)
+{
+    in->mark = in->position;
+    return in->position;
+}
+
+inline void InputRelease(InputSource *in)
+{
+    in->mark = INPUT_NO_MARK;
+}
+
+inline bool InputRewind(InputSource *in, uint64_t offset)
+{
+    if ((offset < in->start) || (offset > in->end))
+        return false;
+    in->position = offset;
+    return true;
+}
+
+/** @brief Tokenizes bytes[0, length), the next part of the input, as far as it can
+    @note The tokens are added to ctx->tokens (NextToken hands them out and drops them). A token
+    cut by the end of the bytes is tokenized again from its start once the bytes after its start
+    have doubled, so a long token arriving in small parts is scanned a few times and not once per
+    part. The buffer keeps its text and grows to hold the longest one. Every context keeps its own input, so
+    one thread can tokenize many streams by feeding their contexts as data arrives
+    @return The number of tokens added, or FEED_FAILED if the buffer could not grow to take the
+    bytes. The bytes not taken are dropped, the tokens made before stay in ctx->tokens
+*/
+inline uint64_t Feed(ParserContext *ctx, const char *bytes, uint64_t length)
+{
+    if (!ctx->pushing)
+    {
+        ctx->pushInput = CreateInputSource(NULL, NULL, 4096);
+        ctx->pushing = true;
+    }
+    InputSource *in = &ctx->pushInput;
+    uint64_t tokenCount = ctx->tokens.size;
+    while (length > 0)
+    {
+        uint64_t copied = PushInput(in, bytes, length);
+        if (copied == 0)
+            return FEED_FAILED;
+        bytes += copied;
+        length -= copied;
+        if (in->end < in->resumeAt)
+            continue;
+        while (ParseReaderStep(ctx, in))
+            ;
+        in->resumeAt = in->position + 2 * (in->end - in->position);
+    }
+    return ctx->tokens.size - tokenCount;
+}
+
+// Tokenizes what is left of the pushed input now that it is known to end there
+inline uint64_t Finish(ParserContext *ctx)
+{
+    if (!ctx->pushing)
+        return 0;
+    uint64_t tokenCount = ctx->tokens.size;
+    ctx->pushInput.ended = true;
+    ParseReader(ctx, &ctx->pushInput);
+    FreeInputSource(&ctx->pushInput);
+    ctx->pushing = false;
+    return ctx->tokens.size - tokenCount;
+}
+
+inline uint64_t PushInput(InputSource *in, const char *bytes, uint64_t length)
+{
+    // Everything before the mark (the start of the token being parsed) was tokenized already
+    in->start = ((in->mark != INPUT_NO_MARK) && (in->mark < in->position)) ? in->mark : in->position;
+    if ((in->end - in->start == in->capacity) && !GrowInputSource(in))
+        return 0;
+    uint64_t copied = 0;
+    while ((copied < length) && (in->end - in->start < in->capacity))
+    {
+        uint64_t index = in->end & (in->capacity - 1);
+        uint64_t count = in->capacity - (in->end - in->start);
+        if (count > in->capacity - index)
+            count = in->capacity - index;
+        if (count > length - copied)
+            count = length - copied;
+        memcpy(in->buffer + index, bytes + copied, count);
+        in->end += count;
+        copied += count;
+    }
+    return copied;
+}
+
+inline bool GrowInputSource(InputSource *in)
+{
+    uint64_t capacity = in->capacity * 2;
+    char *buffer = (char *)TOKA_MALLOC(capacity);
+    if (buffer == NULL)
+        return false;
+    for (uint64_t o = in->start; o < in->end; o++)
+        buffer[o & (capacity - 1)] = in->buffer[o & (in->capacity - 1)];
+    TOKA_FREE(in->buffer);
+    in->buffer = buffer;
+    in->capacity = capacity;
+    return true;
+}
+
+/** @brief Runs the reader parsing functions over the whole input
+    @note Tokens pile up in ctx->tokens, use OpenReaderTokenStream and NextToken to tokenize an
+    unbounded input in constant memory
+*/
+inline void ParseReader(ParserContext *ctx, InputSource *in)
+{
+    while (ParseReaderStep(ctx, in))
+        ;
+    InputRelease(in);
+}
+
+/** @brief Reads the next character of the input and tries the rules on it, false at the end
+    @note Works like ParseFileStep (cursorOffset is the offset after the character) and marks the
+    character so the rules can rewind to anywhere in their token. With ctx->profiling set the
+    step is run by ParseReaderStepProfiled.
+    When a rule reads past the bytes fed to a pushed input so far, whatever it did is undone and
+    the input is rewound to the mark, so the step runs again once more bytes arrive (in->starved
+    tells this apart from the end of the input)
+*/
+inline bool ParseReaderStep(ParserContext *ctx, InputSource *in)
+{
+    if (ctx->profiling)
+        return ParseReaderStepProfiled(ctx, in);
+    in->starved = false;
+    uint64_t mark = InputMark(in);
+    int next = InputGet(in);
+    if (next == EOF)
+        return false;
+    char c = (char)next;
+    ctx->cursorOffset = InputTell(in);
+    uint64_t lineNumber = ctx->lineNumber, charNumber = ctx->charNumber, tokenCount = ctx->tokens.size;
+    // Only pushed inputs starve, the skipped tokens of their steps are remembered to be undone
+    ctx->recordingSkips = (in->read == NULL);
+    ctx->stepSkips.size = 0;
+    uint64_t first, end;
+    RULE_CANDIDATES(ctx, c, first, end)
+    for (uint64_t k = first; k < end; k++)
+    {
+        ParsingRule *rule = RULE_CANDIDATE(ctx, k);
+        if (ctx->rulesCompiled || RULE_ACCEPTS(rule, c))
+        {
+            long cursorPos = ctx->cursorOffset;
+            rule->func.readerFunction(ctx, c, in);
+            if (in->starved)
+            {
+                UndoStarvedStep(ctx, in, mark, lineNumber, charNumber, tokenCount);
+                return false;
+            }
+            if (ctx->cursorOffset != cursorPos)
+            {
+                if (ctx->adaptiveOrdering)
+                    NoteRuleWin(ctx, c, k);
+                break;
+            }
+        }
+    }
+    ctx->recordingSkips = false;
+    return true;
+}
+
+inline void UndoStarvedStep(ParserContext *ctx, InputSource *in, uint64_t mark, uint64_t lineNumber, uint64_t charNumber, uint64_t tokenCount)
+{
+    while (ctx->tokens.size > tokenCount)
+    {
+        ctx->tokens.size--;
+        if (!ctx->useArena)
+            FREE_ARRAY(ctx->tokens.arr[ctx->tokens.size].value)
+    }
+    for (uint64_t i = 0; i < ctx->stepSkips.size; i++)
+    {
+        int64_t typeId = (int64_t)ctx->stepSkips.arr[i];
+        if (ctx->countingTypes && (typeId >= 0) && ((uint64_t)typeId < ctx->typeCounts.size))
+            ctx->typeCounts.arr[typeId]--;
+    }
+    ctx->skippedTokens -= ctx->stepSkips.size;
+    ctx->recordingSkips = false;
+    ctx->lineNumber = lineNumber;
+    ctx->charNumber = charNumber;
+    ctx->cursorOffset = mark;
+    InputRewind(in, mark);
+}
+
+/** @brief Runs the string parsing functions over ctx->source until ctx->sourceSize is reached
+    @note Characters that no rule manages to parse are skipped
+*/
+inline void ParseBuffer(ParserContext *ctx)
+{
+    ParseBufferRange(ctx, ctx->sourceSize);
+}
+
+// Keeps parsing while the cursor is before end, the last token may extend past end
+inline void ParseBufferRange(ParserContext *ctx, uint64_t end)
+{
+    while ((uint64_t)ctx->cursorOffset < end)
+        ParseBufferStep(ctx);
+}
+
+// Tries the rules at the cursor once, skipping the character if none of them parse it
+inline void ParseBufferStep(ParserContext *ctx)
+{
+    if (ctx->profiling)
+    {
+        ParseBufferStepProfiled(ctx);
+        return;
+    }
+    char *src = ctx->source;
+    long cursorPos = ctx->cursorOffset;
+    char c = src[cursorPos];
+    ctx->stepReach = ctx->furthestRead;
+    // The patterns get the first shot, the hand written rules handle what they don't match
+    if (ctx->lexer.compiled && MatchPatterns(ctx))
+        return;
+    uint64_t first, end;
+    RULE_CANDIDATES(ctx, c, first, end)
+    for (uint64_t k = first; k < end; k++)
+    {
+        ParsingRule *rule = RULE_CANDIDATE(ctx, k);
+        if (ctx->rulesCompiled || RULE_ACCEPTS(rule, c))
+        {
+            rule->func.stringFunction(ctx, c, src);
+            // If parsing succeeded add token, else continue testing
+            if (ctx->cursorOffset != cursorPos)
+            {
+                if (ctx->adaptiveOrdering)
+                    NoteRuleWin(ctx, c, k);
+                break;
+            }
+        }
+    }
+    if (ctx->cursorOffset == cursorPos)
+        ctx->cursorOffset++;
+    // Rules are assumed to look at the character after what they consumed
+    NOTE_READ(ctx, ctx->cursorOffset)
+}
+
+inline void ParseBufferStepProfiled(ParserContext *ctx)
+{
+    char *src = ctx->source;
+    long cursorPos = ctx->cursorOffset;
+    char c = src[cursorPos];
+    ctx->stepReach = ctx->furthestRead;
+    if (ctx->lexer.compiled)
+    {
+        RuleProfile *profile = &ctx->patternProfile;
+        uint64_t start = ReadCycleCounter();
+        bool matched = MatchPatterns(ctx);
+        profile->cycles += ReadCycleCounter() - start;
+        profile->invocations++;
+        if (matched)
+        {
+            profile->successes++;
+            profile->bytesConsumed += ctx->cursorOffset - cursorPos;
+            return;
+        }
+        profile->failures++;
+    }
+    uint64_t first, end;
+    RULE_CANDIDATES(ctx, c, first, end)
+    for (uint64_t k = first; k < end; k++)
+    {
+        ParsingRule *rule = RULE_CANDIDATE(ctx, k);
+        if (!ctx->rulesCompiled)
+        {
+            rule->profile.conditionCalls++;
+            if (!RULE_ACCEPTS(rule, c))
+                continue;
+        }
+        rule->profile.conditionHits++;
+        rule->profile.invocations++;
+        uint64_t start = ReadCycleCounter();
+        rule->func.stringFunction(ctx, c, src);
+        rule->profile.cycles += ReadCycleCounter() - start;
+        if (ctx->cursorOffset != cursorPos)
+        {
+            rule->profile.successes++;
+            rule->profile.bytesConsumed += ctx->cursorOffset - cursorPos;
+            if (ctx->adaptiveOrdering)
+                NoteRuleWin(ctx, c, k);
+            break;
+        }
+        rule->profile.failures++;
+    }
+    if (ctx->cursorOffset == cursorPos)
+        ctx->cursorOffset++;
+    NOTE_READ(ctx, ctx->cursorOffset)
+}
+
+inline bool ParseFileStepProfiled(ParserContext *ctx, FILE *file)
+{
+    char c = fgetc(file);
+    if (c == EOF)
+        return false;
+    ctx->cursorOffset = ftell(file);
+    uint64_t first, end;
+    RULE_CANDIDATES(ctx, c, first, end)
+    for (uint64_t k = first; k < end; k++)
+    {
+        ParsingRule *rule = RULE_CANDIDATE(ctx, k);
+        if (!ctx->rulesCompiled)
+        {
+            rule->profile.conditionCalls++;
+            if (!RULE_ACCEPTS(rule, c))
+                continue;
+        }
+        rule->profile.conditionHits++;
+        rule->profile.invocations++;
+        long cursorPos = ctx->cursorOffset;
+        uint64_t start = ReadCycleCounter();
+        rule->func.fileFunction(ctx, c, file);
+        rule->profile.cycles += ReadCycleCounter() - start;
+        if (ctx->cursorOffset != cursorPos)
+        {
+            rule->profile.successes++;
+            // The file position is what really moved, the rules don't all keep cursorOffset exact
+            rule->profile.bytesConsumed += ftell(file) - (cursorPos - 1);
+            if (ctx->adaptiveOrdering)
+                NoteRuleWin(ctx, c, k);
+            break;
+        }
+        rule->profile.failures++;
+    }
+    return true;
+}
+
+// A starved step runs again once more input is pushed, so its attempts are not counted (only the
+// cycles they spent are)
+inline bool ParseReaderStepProfiled(ParserContext *ctx, InputSource *in)
+{
+    in->starved = false;
+    uint64_t mark = InputMark(in);
+    int next = InputGet(in);
+    if (next == EOF)
+        return false;
+    char c = (char)next;
+    ctx->cursorOffset = InputTell(in);
+    uint64_t lineNumber = ctx->lineNumber, charNumber = ctx->charNumber, tokenCount = ctx->tokens.size;
+    ctx->recordingSkips = (in->read == NULL);
+    ctx->stepSkips.size = 0;
+    uint64_t first, end;
+    RULE_CANDIDATES(ctx, c, first, end)
+    for (uint64_t k = first; k < end; k++)
+    {
+        ParsingRule *rule = RULE_CANDIDATE(ctx, k);
+        if (!ctx->rulesCompiled)
+        {
+            rule->profile.conditionCalls++;
+            if (!RULE_ACCEPTS(rule, c))
+                continue;
+        }
+        rule->profile.conditionHits++;
+        rule->profile.invocations++;
+        long cursorPos = ctx->cursorOffset;
+        uint64_t start = ReadCycleCounter();
+        rule->func.readerFunction(ctx, c, in);
+        rule->profile.cycles += ReadCycleCounter() - start;
+        if (in->starved)
+        {
+            // The step runs again, the candidates tried so far must not be counted twice
+            for (uint64_t j = first; j <= k; j++)
+            {
+                ParsingRule *tried = RULE_CANDIDATE(ctx, j);
+                if (!ctx->rulesCompiled)
+                {
+                    tried->profile.conditionCalls--;
+                    if (!RULE_ACCEPTS(tried, c))
+                        continue;
+                }
+                tried->profile.conditionHits--;
+                tried->profile.invocations--;
+                if (j < k)
+                    tried->profile.failures--;
+            }
+            UndoStarvedStep(ctx, in, mark, lineNumber, charNumber, tokenCount);
+            return false;
+        }
+        if (ctx->cursorOffset != cursorPos)
+        {
+            rule->profile.successes++;
+            // Like the file step, the input position is what really moved
+            rule->profile.bytesConsumed += InputTell(in) - (cursorPos - 1);
+            if (ctx->adaptiveOrdering)
+                NoteRuleWin(ctx, c, k);
+            break;
+        }
+        rule->profile.failures++;
+    }
+    ctx->recordingSkips = false;
+    return true;
+}
+
+inline void EnableRuleProfiling(ParserContext *ctx, bool enable)
+{
+    ctx->profiling = enable;
+}
+
+inline void ResetRuleProfiles(ParserContext *ctx)
+{
+    for (uint64_t i = 0; i < ctx->rules.size; i++)
+        memset(&ctx->rules.arr[i].profile, 0, sizeof(RuleProfile));
+    memset(&ctx->patternProfile, 0, sizeof(RuleProfile));
+}
+
+inline void PrintRuleProfiles(const ParserContext *ctx, FILE *out)
+{
+    fprintf(out, "%-28s %12s %12s %12s %12s %12s %7s %12s %14s %10s\n", "rule", "cond calls", "cond hits",
+            "calls", "successes", "failures", "fail %", "bytes", "cycles", "cycles/B");
+    for (uint64_t i = 0; i <= ctx->rules.size; i++)
+    {
+        const RuleProfile *profile;
+        const char *name;
+        if (i < ctx->rules.size)
+        {
+            profile = &ctx->rules.arr[i].profile;
+            name = (ctx->rules.arr[i].name != NULL) ? ctx->rules.arr[i].name : "";
+        }
+        else if (ctx->lexer.compiled)
+        {
+            profile = &ctx->patternProfile;
+            name = "(patterns)";
+        }
+        else
+            break;
+        double failRate = (profile->invocations > 0) ? 100.0 * profile->failures / profile->invocations : 0;
+        double cyclesPerByte = (profile->bytesConsumed > 0) ? (double)profile->cycles / profile->bytesConsumed : 0;
+        fprintf(out, "%-28.28s %12llu %12llu %12llu %12llu %12llu %7.1f %12llu %14llu %10.1f\n", name,
+                (unsigned long long)profile->conditionCalls, (unsigned long long)profile->conditionHits,
+                (unsigned long long)profile->invocations, (unsigned long long)profile->successes,
+                (unsigned long long)profile->failures, failRate, (unsigned long long)profile->bytesConsumed,
+                (unsigned long long)profile->cycles, cyclesPerByte);
+    }
+}
+
+// Time stamp counter on x86 and the virtual counter on ARM64, clock() anywhere else
+inline uint64_t ReadCycleCounter(void)
+{
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t value;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#else
+    return (uint64_t)clock();
+#endif
+}
+
+inline bool MapFile(const char *path, MappedFile *file)
+{
+    memset(file, 0, sizeof(MappedFile));
+#if defined(TOKA_HAS_MMAP)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    // The bytes past the end of the file up to the page boundary are zero, so the mapping
+    // is NUL terminated for free unless the file ends exactly on a page boundary
+    if ((fstat(fd, &st) == 0) && (st.st_size > 0) && ((st.st_size % pageSize) != 0))
+    {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+#if defined(MADV_SEQUENTIAL)
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+#endif
+            close(fd);
+            file->data = (char *)data;
+            file->size = st.st_size;
+            file->mapped = true;
+            return true;
+        }
+    }
+    close(fd);
+#elif defined(_WIN32)
+    HANDLE fileHandle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                    FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (fileHandle == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER fileSize;
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    if (GetFileSizeEx(fileHandle, &fileSize) && (fileSize.QuadPart > 0) &&
+        ((fileSize.QuadPart % info.dwPageSize) != 0))
+    {
+        HANDLE mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mappingHandle != NULL)
+        {
+            void *data = MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+            if (data != NULL)
+            {
+                file->data = (char *)data;
+                file->size = fileSize.QuadPart;
+                file->mapped = true;
+                file->fileHandle = fileHandle;
+                file->mappingHandle = mappingHandle;
+                return true;
+            }
+            CloseHandle(mappingHandle);
+        }
+    }
+    CloseHandle(fileHandle);
+#endif
+    // Fallback: read the whole file into a NUL terminated buffer
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return false;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (size < 0)
+    {
+        fclose(f);
+        return false;
+    }
+    file->data = (char *)TOKA_MALLOC(size + 1);
+    if (file->data == NULL)
+    {
+        fclose(f);
+        return false;
+    }
+    file->size = fread(file->data, 1, size, f);
+    file->data[file->size] = '\0';
+    file->mapped = false;
+    fclose(f);
+    return true;
+}
+
+inline void UnmapFile(MappedFile *file)
+{
+    if (file->data == NULL)
+        return;
+    if (file->mapped)
+    {
+#if defined(TOKA_HAS_MMAP)
+        munmap(file->data, file->size);
+#elif defined(_WIN32)
+        UnmapViewOfFile(file->data);
+        CloseHandle(file->mappingHandle);
+        CloseHandle(file->fileHandle);
+#endif
+    }
+    else
+        TOKA_FREE(file->data);
+    memset(file, 0, sizeof(MappedFile));
+}
+
+/** @brief Parses a file through a memory mapping instead of stdio
+    @note The rules are fed the mapping as a string so they must be string parsing functions
+    (the context must not be in fileMode). The mapping stays alive until the context is reset
+    @return false if the file could not be opened
+*/
+inline bool ParseMappedFile(ParserContext *ctx, char *path)
+{
+    UnmapFile(&ctx->sourceFile);
+    if (!MapFile(path, &ctx->sourceFile))
+        return false;
+    ctx->source = ctx->sourceFile.data;
+    ctx->sourceSize = ctx->sourceFile.size;
+    ctx->cursorOffset = 0;
+    ParseBuffer(ctx);
+    return true;
+}
+
+/** @brief Appends a token covering source[offset, offset + length) to the context
+    @note In spanTokens mode no memory is allocated for the text, the token only remembers
+    where it is, otherwise the text is copied into the token's value with a single allocation
+*/
+inline void AppendToken(ParserContext *ctx, Token t, uint64_t offset, uint64_t length)
+{
+    if (!TokenTypeWanted(ctx, t.typeId))
+    {
+        SkipToken(ctx, t.typeId);
+        return;
+    }
+    t.offset = offset;
+    t.length = length;
+    t.priorReach = ctx->stepReach;
+    if (ctx->spanTokens)
+    {
+        INIT_ARRAY(char, t.value, 0);
+        t.symbol = ctx->interning ? InternText(&ctx->interner, ctx->source + offset, length) : 0;
+    }
+    else
+        SetTokenValue(ctx, &t, ctx->source + offset, length);
+    APPEND_TO_ARRAY(Token, ctx->tokens, t)
+}
+
+inline void AppendTokenText(ParserContext *ctx, Token t, uint64_t offset, const char *text, uint64_t length)
+{
+    if (!TokenTypeWanted(ctx, t.typeId))
+    {
+        SkipToken(ctx, t.typeId);
+        return;
+    }
+    t.offset = offset;
+    t.length = length;
+    t.priorReach = ctx->stepReach;
+    SetTokenValue(ctx, &t, text, length);
+    APPEND_TO_ARRAY(Token, ctx->tokens, t)
+}
+
+inline void SetTokenValue(ParserContext *ctx, Token *t, const char *text, uint64_t length)
+{
+    t->symbol = 0;
+    if (ctx->interning)
+    {
+        // Shared with every token spelled the same way, capacity 0 marks it as not owned
+        t->symbol = InternText(&ctx->interner, text, length);
+        t->value.arr = (char *)SymbolText(&ctx->interner, t->symbol);
+        t->value.size = length + 1;
+        t->value.capacity = 0;
+        return;
+    }
+    if (ctx->useArena)
+    {
+        // Capacity 0 marks the value as not owned by the token
+        t->value.arr = (char *)ArenaAlloc(&ctx->arena, length + 1);
+        t->value.capacity = 0;
+    }
+    else
+    {
+        INIT_ARRAY(char, t->value, length + 1);
+    }
+    memcpy(t->value.arr, text, length);
+    t->value.arr[length] = '\0';
+    t->value.size = length + 1;
+}
+
+inline void KeepTokenTypes(ParserContext *ctx, const int *typeIds, uint64_t count)
+{
+    int largest = -1;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        if (typeIds[i] > largest)
+            largest = typeIds[i];
+    }
+    TOKA_FREE(ctx->keepTypes);
+    ctx->keepTypeWords = (uint64_t)(largest + 64) / 64;
+    ctx->keepTypes = (uint64_t *)TOKA_CALLOC(ctx->keepTypeWords, sizeof(uint64_t));
+    for (uint64_t i = 0; i < count; i++)
+    {
+        if (typeIds[i] >= 0)
+            ctx->keepTypes[typeIds[i] >> 6] |= (uint64_t)1 << (typeIds[i] & 63);
+    }
+    ctx->filteringTypes = true;
+}
+
+inline void KeepAllTokenTypes(ParserContext *ctx)
+{
+    TOKA_FREE(ctx->keepTypes);
+    ctx->keepTypes = NULL;
+    ctx->keepTypeWords = 0;
+    ctx->filteringTypes = false;
+}
+
+inline bool TokenTypeWanted(const ParserContext *ctx, int typeId)
+{
+    if (ctx->countingTypes)
+        return false;
+    if (!ctx->filteringTypes)
+        return true;
+    return (typeId >= 0) && ((uint64_t)typeId < ctx->keepTypeWords * 64) &&
+           ((ctx->keepTypes[typeId >> 6] >> (typeId & 63)) & 1);
+}
+
+inline void CountTokenTypes(ParserContext *ctx, bool counting)
+{
+    ctx->countingTypes = counting;
+    if (ctx->typeCounts.size > 0)
+        memset(ctx->typeCounts.arr, 0, ctx->typeCounts.size * sizeof(uint64_t));
+    ctx->skippedTokens = 0;
+}
+
+inline uint64_t TokenTypeCount(const ParserContext *ctx, int typeId)
+{
+    if ((typeId < 0) || ((uint64_t)typeId >= ctx->typeCounts.size))
+        return 0;
+    return ctx->typeCounts.arr[typeId];
+}
+
+inline void SkipToken(ParserContext *ctx, int typeId)
+{
+    if (ctx->recordingSkips)
+        APPEND_TO_ARRAY(uint64_t, ctx->stepSkips, (uint64_t)(int64_t)typeId)
+    ctx->skippedTokens++;
+    if (!ctx->countingTypes || (typeId < 0))
+        return;
+    if ((uint64_t)typeId >= ctx->typeCounts.size)
+    {
+        uint64_t size = ((uint64_t)typeId + 64) & ~(uint64_t)63;
+        uint64_t *counts = (uint64_t *)TOKA_REALLOC(ctx->typeCounts.arr, size * sizeof(uint64_t));
+        if (counts == NULL)
+            return;
+        memset(counts + ctx->typeCounts.size, 0, (size - ctx->typeCounts.size) * sizeof(uint64_t));
+        ctx->typeCounts.arr = counts;
+        ctx->typeCounts.size = ctx->typeCounts.capacity = size;
+    }
+    ctx->typeCounts.arr[typeId]++;
+}
+
+inline char *TokenText(ParserContext *ctx, Token *t)
+{
+    if (t->value.arr != NULL)
+        return t->value.arr;
+    return ctx->source + t->offset;
+}
+
+inline char *MaterializeToken(ParserContext *ctx, Token *t)
+{
+    if (t->value.arr == NULL)
+        SetTokenValue(ctx, t, ctx->source + t->offset, t->length);
+    return t->value.arr;
+}
+
+inline TokenColumns CreateTokenColumns(bool keepText)
+{
+    TokenColumns columns;
+    memset(&columns, 0, sizeof(TokenColumns));
+    columns.keepText = keepText;
+    INIT_ARRAY(char, columns.text, 0);
+    return columns;
+}
+
+// Grows every column together, returns false if an allocation failed
+inline bool ReserveTokenColumns(TokenColumns *columns, uint64_t capacity)
+{
+    if (capacity <= columns->capacity)
+        return true;
+    if (capacity < columns->capacity * 2)
+        capacity = columns->capacity * 2;
+    int32_t *typeIds = (int32_t *)TOKA_REALLOC(columns->typeIds, capacity * sizeof(int32_t));
+    if (typeIds != NULL)
+        columns->typeIds = typeIds;
+    uint32_t *lines = (uint32_t *)TOKA_REALLOC(columns->lines, capacity * sizeof(uint32_t));
+    if (lines != NULL)
+        columns->lines = lines;
+    uint32_t *at = (uint32_t *)TOKA_REALLOC(columns->columns, capacity * sizeof(uint32_t));
+    if (at != NULL)
+        columns->columns = at;
+    uint64_t *offsets = (uint64_t *)TOKA_REALLOC(columns->offsets, capacity * sizeof(uint64_t));
+    if (offsets != NULL)
+        columns->offsets = offsets;
+    uint32_t *lengths = (uint32_t *)TOKA_REALLOC(columns->lengths, capacity * sizeof(uint32_t));
+    if (lengths != NULL)
+        columns->lengths = lengths;
+    bool grown = (typeIds != NULL) && (lines != NULL) && (at != NULL) && (offsets != NULL) && (lengths != NULL);
+    if (columns->keepText)
+    {
+        uint64_t *textStarts = (uint64_t *)TOKA_REALLOC(columns->textStarts, capacity * sizeof(uint64_t));
+        if (textStarts != NULL)
+            columns->textStarts = textStarts;
+        grown &= (textStarts != NULL);
+    }
+    // A column that failed keeps its old capacity so the others can't be used beyond it
+    if (grown)
+        columns->capacity = capacity;
+    return grown;
+}
+
+inline void AppendTokenColumn(TokenColumns *columns, ParserContext *ctx, Token *t)
+{
+    if (!ReserveTokenColumns(columns, columns->size + 1))
+        return;
+    uint64_t i = columns->size++;
+    columns->typeIds[i] = t->typeId;
+    columns->lines[i] = (uint32_t)t->line;
+    columns->columns[i] = (uint32_t)t->at;
+    columns->offsets[i] = t->offset;
+    columns->lengths[i] = (uint32_t)t->length;
+    if (columns->keepText)
+    {
+        // value.size is the text length + 1 when the token has a value, the span length otherwise
+        uint64_t length = (t->value.arr != NULL) ? t->value.size - 1 : t->length;
+        String *pool = &columns->text;
+        if (pool->size + length + 1 > pool->capacity)
+        {
+            uint64_t capacity = (pool->capacity > 0) ? pool->capacity * 2 : 4096;
+            while (capacity < pool->size + length + 1)
+                capacity *= 2;
+            char *arr = (char *)TOKA_REALLOC(pool->arr, capacity);
+            if (arr == NULL)
+                length = 0;
+            else
+            {
+                pool->arr = arr;
+                pool->capacity = capacity;
+            }
+        }
+        columns->textStarts[i] = pool->size;
+        if (pool->size + length + 1 <= pool->capacity)
+        {
+            memcpy(pool->arr + pool->size, TokenText(ctx, t), length);
+            pool->arr[pool->size + length] = '\0';
+            pool->size += length + 1;
+        }
+    }
+    // Types come in runs, so the last type found is checked first
+    uint64_t last = columns->typeNameCount;
+    if ((last > 0) && (columns->typeNames[last - 1].typeId == t->typeId))
+        return;
+    for (uint64_t k = 0; k < columns->typeNameCount; k++)
+    {
+        if (columns->typeNames[k].typeId == t->typeId)
+        {
+            TokenTypeName found = columns->typeNames[k];
+            columns->typeNames[k] = columns->typeNames[last - 1];
+            columns->typeNames[last - 1] = found;
+            return;
+        }
+    }
+    TokenTypeName *typeNames =
+        (TokenTypeName *)TOKA_REALLOC(columns->typeNames, (last + 1) * sizeof(TokenTypeName));
+    if (typeNames == NULL)
+        return;
+    typeNames[last].typeId = t->typeId;
+    typeNames[last].type = t->type;
+    columns->typeNames = typeNames;
+    columns->typeNameCount++;
+}
+
+inline void TokensToColumns(ParserContext *ctx, TokenColumns *columns)
+{
+    ReserveTokenColumns(columns, columns->size + ctx->tokens.size);
+    for (uint64_t i = 0; i < ctx->tokens.size; i++)
+        AppendTokenColumn(columns, ctx, &ctx->tokens.arr[i]);
+}
+
+inline bool ParseToColumns(ParserContext *ctx, char *src, TokenColumns *columns)
+{
+    if (!OpenTokenStream(ctx, src))
+        return false;
+    Token t;
+    while (NextToken(ctx, &t))
+        AppendTokenColumn(columns, ctx, &t);
+    CloseTokenStream(ctx);
+    return true;
+}
+
+inline Token TokenColumnView(const TokenColumns *columns, uint64_t i)
+{
+    Token t;
+    memset(&t, 0, sizeof(Token));
+    t.typeId = columns->typeIds[i];
+    t.type = TokenColumnType(columns, t.typeId);
+    t.line = columns->lines[i];
+    t.at = columns->columns[i];
+    t.offset = columns->offsets[i];
+    t.length = columns->lengths[i];
+    if (columns->keepText && (columns->textStarts[i] < columns->text.size))
+    {
+        // Capacity 0 marks the value as not owned by the token
+        t.value.arr = columns->text.arr + columns->textStarts[i];
+        t.value.size = strlen(t.value.arr) + 1;
+    }
+    return t;
+}
+
+inline char *TokenColumnType(const TokenColumns *columns, int typeId)
+{
+    for (uint64_t k = 0; k < columns->typeNameCount; k++)
+    {
+        if (columns->typeNames[k].typeId == typeId)
+            return columns->typeNames[k].type;
+    }
+    return NULL;
+}
+
+// Only reads the typeIds column, which the compiler turns into a vectorized loop
+inline uint64_t CountTokenType(const TokenColumns *columns, int typeId)
+{
+    uint64_t count = 0;
+    const int32_t *typeIds = columns->typeIds;
+    for (uint64_t i = 0; i < columns->size; i++)
+        count += (typeIds[i] == typeId);
+    return count;
+}
+
+inline void FreeTokenColumns(TokenColumns *columns)
+{
+    TOKA_FREE(columns->typeIds);
+    TOKA_FREE(columns->lines);
+    TOKA_FREE(columns->columns);
+    TOKA_FREE(columns->offsets);
+    TOKA_FREE(columns->lengths);
+    TOKA_FREE(columns->textStarts);
+    TOKA_FREE(columns->typeNames);
+    FREE_ARRAY(columns->text)
+    bool keepText = columns->keepText;
+    *columns = CreateTokenColumns(keepText);
+}
+
+/////////////////////TOKEN FILES///////////////////////
+/*
+ * Layout, integers are little endian and varints are LEB128:
+ * header (TOKEN_FILE_HEADER_SIZE bytes): "TOKA", u32 version, u32 flags, u32 type count,
+ *   u64 token count, then the u64 offsets of the types, records, index and text pool and the
+ *   u64 size of the pool
+ * types: for every type a zigzag varint typeId and its NUL terminated name
+ * records: for every token the varints type index, zigzag(offset - previous offset), length,
+ *   zigzag(line - previous line) and at
+ * index: for every TOKEN_FILE_BLOCK'th token the u64 record position, previous offset,
+ *   previous line and pool position it is decoded with
+ * pool (TOKEN_FILE_HAS_TEXT): the NUL terminated text of every token, in order
+ */
+inline void WriteVarint(FILE *out, uint64_t value)
+{
+    uint8_t bytes[10];
+    int count = 0;
+    do
+    {
+        bytes[count] = (uint8_t)(value & 0x7F);
+        value >>= 7;
+        if (value != 0)
+            bytes[count] |= 0x80;
+        count++;
+    } while (value != 0);
+    fwrite(bytes, 1, count, out);
+}
+
+inline bool ReadVarint(const uint8_t **p, const uint8_t *end, uint64_t *value)
+{
+    uint64_t result = 0;
+    for (int shift = 0; (shift < 64) && (*p < end); shift += 7)
+    {
+        uint8_t byte = *(*p)++;
+        result |= (uint64_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void WriteLE(FILE *out, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        fputc((int)((value >> (8 * i)) & 0xFF), out);
+}
+
+inline uint64_t ReadLE(const uint8_t *p, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++)
+        value |= (uint64_t)p[i] << (8 * i);
+    return value;
+}
+
+/** @brief Writes the tokens of ctx in the binary token file format
+    @note Without withText the file only tells where the tokens are, the reader then needs the
+    source to get their text. Returns false if the file could not be written
+*/
+inline bool WriteTokenFile(ParserContext *ctx, const char *path, bool withText)
+{
+    // Distinct types in order of appearance, records refer to them by index
+    TokenColumns types = CreateTokenColumns(false);
+    uint64_t blockCount = (ctx->tokens.size + TOKEN_FILE_BLOCK - 1) / TOKEN_FILE_BLOCK;
+    uint32_t *typeIndices = (uint32_t *)TOKA_MALLOC((ctx->tokens.size + 1) * sizeof(uint32_t));
+    uint64_t *index = (uint64_t *)TOKA_MALLOC((blockCount * 4 + 1) * sizeof(uint64_t));
+    bool allocated = (typeIndices != NULL) && (index != NULL);
+    for (uint64_t i = 0; allocated && (i < ctx->tokens.size); i++)
+    {
+        Token *t = &ctx->tokens.arr[i];
+        uint32_t k = 0;
+        while ((k < types.typeNameCount) && (types.typeNames[k].typeId != t->typeId))
+            k++;
+        if (k == types.typeNameCount)
+        {
+            TokenTypeName *typeNames =
+                (TokenTypeName *)TOKA_REALLOC(types.typeNames, (k + 1) * sizeof(TokenTypeName));
+            if (typeNames == NULL)
+            {
+                allocated = false;
+                break;
+            }
+            typeNames[k].typeId = t->typeId;
+            typeNames[k].type = t->type;
+            types.typeNames = typeNames;
+            types.typeNameCount++;
+        }
+        typeIndices[i] = k;
+    }
+    // Nothing is written when the tables could not be made
+    FILE *out = allocated ? fopen(path, "wb") : NULL;
+    if (out == NULL)
+    {
+        TOKA_FREE(index);
+        TOKA_FREE(typeIndices);
+        FreeTokenColumns(&types);
+        return false;
+    }
+    uint64_t typesOffset = TOKEN_FILE_HEADER_SIZE;
+    fseek(out, typesOffset, SEEK_SET);
+    for (uint64_t k = 0; k < types.typeNameCount; k++)
+    {
+        int64_t typeId = types.typeNames[k].typeId;
+        WriteVarint(out, ((uint64_t)typeId << 1) ^ (uint64_t)(typeId >> 63));
+        const char *name = (types.typeNames[k].type != NULL) ? types.typeNames[k].type : "";
+        fwrite(name, 1, strlen(name) + 1, out);
+    }
+    uint64_t recordsOffset = ftell(out);
+    uint64_t offset = 0, line = 0, poolPos = 0;
+    for (uint64_t i = 0; i < ctx->tokens.size; i++)
+    {
+        Token *t = &ctx->tokens.arr[i];
+        if ((i % TOKEN_FILE_BLOCK) == 0)
+        {
+            uint64_t *entry = index + (i / TOKEN_FILE_BLOCK) * 4;
+            entry[0] = ftell(out) - recordsOffset;
+            entry[1] = offset;
+            entry[2] = line;
+            entry[3] = poolPos;
+        }
+        int64_t offsetDelta = (int64_t)(t->offset - offset);
+        int64_t lineDelta = (int64_t)((uint64_t)t->line - line);
+        WriteVarint(out, typeIndices[i]);
+        WriteVarint(out, ((uint64_t)offsetDelta << 1) ^ (uint64_t)(offsetDelta >> 63));
+        WriteVarint(out, t->length);
+        WriteVarint(out, ((uint64_t)lineDelta << 1) ^ (uint64_t)(lineDelta >> 63));
+        WriteVarint(out, (uint64_t)t->at);
+        offset = t->offset;
+        line = (uint64_t)t->line;
+        if (withText)
+            poolPos += ((t->value.arr != NULL) ? strlen(t->value.arr) : t->length) + 1;
+    }
+    uint64_t indexOffset = ftell(out);
+    for (uint64_t k = 0; k < blockCount * 4; k++)
+        WriteLE(out, index[k], 8);
+    uint64_t poolOffset = ftell(out);
+    if (withText)
+    {
+        for (uint64_t i = 0; i < ctx->tokens.size; i++)
+        {
+            Token *t = &ctx->tokens.arr[i];
+            uint64_t length = (t->value.arr != NULL) ? strlen(t->value.arr) : t->length;
+            fwrite(TokenText(ctx, t), 1, length, out);
+            fputc('\0', out);
+        }
+    }
+    uint64_t poolSize = ftell(out) - poolOffset;
+    fseek(out, 0, SEEK_SET);
+    fwrite("TOKA", 1, 4, out);
+    WriteLE(out, TOKEN_FILE_VERSION, 4);
+    WriteLE(out, withText ? TOKEN_FILE_HAS_TEXT : 0, 4);
+    WriteLE(out, types.typeNameCount, 4);
+    WriteLE(out, ctx->tokens.size, 8);
+    WriteLE(out, typesOffset, 8);
+    WriteLE(out, recordsOffset, 8);
+    WriteLE(out, indexOffset, 8);
+    WriteLE(out, poolOffset, 8);
+    WriteLE(out, poolSize, 8);
+    bool written = (ferror(out) == 0);
+    written &= (fclose(out) == 0);
+    TOKA_FREE(index);
+    TOKA_FREE(typeIndices);
+    FreeTokenColumns(&types);
+    return written;
+}
+
+inline bool OpenTokenFile(TokenFileReader *reader, const char *path)
+{
+    memset(reader, 0, sizeof(TokenFileReader));
+    if (!MapFile(path, &reader->file))
+        return false;
+    const uint8_t *data = (const uint8_t *)reader->file.data;
+    uint64_t size = reader->file.size;
+    bool valid = (size >= TOKEN_FILE_HEADER_SIZE) && (memcmp(data, "TOKA", 4) == 0) &&
+                 (ReadLE(data + 4, 4) == TOKEN_FILE_VERSION);
+    uint64_t typesOffset = 0, recordsOffset = 0, indexOffset = 0, poolOffset = 0;
+    if (valid)
+    {
+        reader->version = (uint32_t)ReadLE(data + 4, 4);
+        reader->flags = (uint32_t)ReadLE(data + 8, 4);
+        reader->typeCount = (uint32_t)ReadLE(data + 12, 4);
+        reader->tokenCount = ReadLE(data + 16, 8);
+        typesOffset = ReadLE(data + 24, 8);
+        recordsOffset = ReadLE(data + 32, 8);
+        indexOffset = ReadLE(data + 40, 8);
+        poolOffset = ReadLE(data + 48, 8);
+        reader->poolSize = ReadLE(data + 56, 8);
+        // Every section is checked to lie in the file before any sum or product of them is made,
+        // so a crafted header can't wrap around
+        uint64_t blockCount = reader->tokenCount / TOKEN_FILE_BLOCK + ((reader->tokenCount % TOKEN_FILE_BLOCK) != 0);
+        valid = (TOKEN_FILE_HEADER_SIZE <= typesOffset) && (typesOffset <= recordsOffset) &&
+                (recordsOffset <= indexOffset) && (indexOffset <= poolOffset) && (poolOffset <= size) &&
+                (reader->poolSize <= size - poolOffset) && (blockCount == (poolOffset - indexOffset) / 32) &&
+                ((poolOffset - indexOffset) % 32 == 0) &&
+                // A type takes at least two bytes (its id and the NUL of its name)
+                (reader->typeCount <= (recordsOffset - typesOffset) / 2);
+    }
+    if (valid)
+    {
+        reader->types = (TokenTypeName *)TOKA_MALLOC(((uint64_t)reader->typeCount + 1) * sizeof(TokenTypeName));
+        valid = (reader->types != NULL);
+    }
+    if (valid)
+    {
+        const uint8_t *p = data + typesOffset, *end = data + recordsOffset;
+        for (uint32_t k = 0; valid && (k < reader->typeCount); k++)
+        {
+            uint64_t zigzag = 0;
+            valid = ReadVarint(&p, end, &zigzag);
+            if (!valid)
+                break;
+            reader->types[k].typeId = (int)(int64_t)((zigzag >> 1) ^ (~(zigzag & 1) + 1));
+            reader->types[k].type = (char *)p;
+            while (valid && (p < end) && (*p != '\0'))
+                p++;
+            valid = valid && (p < end);
+            p++;
+        }
+    }
+    if (!valid)
+    {
+        CloseTokenFile(reader);
+        return false;
+    }
+    reader->records = data + recordsOffset;
+    reader->recordsEnd = data + indexOffset;
+    reader->index = data + indexOffset;
+    reader->pool = data + poolOffset;
+    return true;
+}
+
+inline bool NextStoredToken(TokenFileReader *reader, Token *t)
+{
+    if (reader->next >= reader->tokenCount)
+        return false;
+    const uint8_t *p = reader->records + reader->recordPos;
+    uint64_t typeIndex, offsetDelta, length, lineDelta, at;
+    if (!(ReadVarint(&p, reader->recordsEnd, &typeIndex) && ReadVarint(&p, reader->recordsEnd, &offsetDelta) &&
+          ReadVarint(&p, reader->recordsEnd, &length) && ReadVarint(&p, reader->recordsEnd, &lineDelta) &&
+          ReadVarint(&p, reader->recordsEnd, &at)) ||
+        (typeIndex >= reader->typeCount))
+        return false;
+    reader->recordPos = p - reader->records;
+    reader->offset += (offsetDelta >> 1) ^ (~(offsetDelta & 1) + 1);
+    reader->line += (lineDelta >> 1) ^ (~(lineDelta & 1) + 1);
+    reader->next++;
+    memset(t, 0, sizeof(Token));
+    t->typeId = reader->types[typeIndex].typeId;
+    t->type = reader->types[typeIndex].type;
+    t->offset = reader->offset;
+    t->length = length;
+    t->line = (long)reader->line;
+    t->at = (long)at;
+    if ((reader->flags & TOKEN_FILE_HAS_TEXT) && (reader->poolPos < reader->poolSize))
+    {
+        // Capacity 0 marks the value as not owned by the token
+        t->value.arr = (char *)reader->pool + reader->poolPos;
+        const char *nul = (const char *)memchr(t->value.arr, '\0', reader->poolSize - reader->poolPos);
+        t->value.size = ((nul != NULL) ? (uint64_t)(nul - t->value.arr) : reader->poolSize - reader->poolPos) + 1;
+        reader->poolPos += t->value.size;
+    }
+    return true;
+}
+
+inline bool SeekStoredToken(TokenFileReader *reader, uint64_t index)
+{
+    if (index > reader->tokenCount)
+        return false;
+    Token t;
+    uint64_t block = index / TOKEN_FILE_BLOCK;
+    if ((index < reader->next) || (block > reader->next / TOKEN_FILE_BLOCK))
+    {
+        if (block * TOKEN_FILE_BLOCK >= reader->tokenCount)
+        {
+            // Seeking to the end, just run out the last block
+            block = (reader->tokenCount > 0) ? (reader->tokenCount - 1) / TOKEN_FILE_BLOCK : 0;
+        }
+        const uint8_t *entry = reader->index + block * 32;
+        reader->next = block * TOKEN_FILE_BLOCK;
+        reader->recordPos = (reader->tokenCount > 0) ? ReadLE(entry, 8) : 0;
+        reader->offset = (reader->tokenCount > 0) ? ReadLE(entry + 8, 8) : 0;
+        reader->line = (reader->tokenCount > 0) ? ReadLE(entry + 16, 8) : 0;
+        reader->poolPos = (reader->tokenCount > 0) ? ReadLE(entry + 24, 8) : 0;
+    }
+    while (reader->next < index)
+    {
+        if (!NextStoredToken(reader, &t))
+            return false;
+    }
+    return true;
+}
+
+inline void CloseTokenFile(TokenFileReader *reader)
+{
+    TOKA_FREE(reader->types);
+    reader->types = NULL;
+    UnmapFile(&reader->file);
+    reader->tokenCount = 0;
+}
+/////////////////////TOKEN FILES END///////////////////////
+
+/////////////////////TOKEN CACHE///////////////////////
+// Cache entries are named "<content hash>-<rule fingerprint>-<content size>.tok" in hexadecimal
+inline bool IsTokenCacheEntry(const char *name)
+{
+    uint64_t length = strlen(name);
+    return (length > 38) && (length < 48) && (strcmp(name + length - 4, ".tok") == 0) && (name[16] == '-') &&
+           (name[33] == '-');
+}
+
+inline void ListTokenCache(const TokenCache *cache, TokenCacheEntryArray *entries)
+{
+    INIT_ARRAY(TokenCacheEntry, (*entries), 0);
+    TokenCacheEntry entry;
+#if defined(_WIN32)
+    char pattern[4096];
+    snprintf(pattern, sizeof(pattern), "%s\\*.tok", cache->directory);
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA(pattern, &data);
+    if (find == INVALID_HANDLE_VALUE)
+        return;
+    do
+    {
+        if (!IsTokenCacheEntry(data.cFileName))
+            continue;
+        strcpy(entry.name, data.cFileName);
+        entry.size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+        entry.modified = ((int64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+        APPEND_TO_ARRAY(TokenCacheEntry, (*entries), entry)
+    } while (FindNextFileA(find, &data));
+    FindClose(find);
+#elif defined(TOKA_HAS_MMAP)
+    DIR *dir = opendir(cache->directory);
+    if (dir == NULL)
+        return;
+    struct dirent *item;
+    while ((item = readdir(dir)) != NULL)
+    {
+        if (!IsTokenCacheEntry(item->d_name))
+            continue;
+        char path[4096];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", cache->directory, item->d_name);
+        if (stat(path, &st) != 0)
+            continue;
+        strcpy(entry.name, item->d_name);
+        entry.size = st.st_size;
+        entry.modified = st.st_mtime;
+        APPEND_TO_ARRAY(TokenCacheEntry, (*entries), entry)
+    }
+    closedir(dir);
+#endif
+}
+
+inline bool OpenTokenCache(TokenCache *cache, const char *directory, uint64_t maxBytes)
+{
+    memset(cache, 0, sizeof(TokenCache));
+#if defined(_WIN32)
+    _mkdir(directory);
+#elif defined(TOKA_HAS_MMAP)
+    mkdir(directory, 0755);
+#endif
+    uint64_t length = strlen(directory);
+    cache->directory = (char *)TOKA_MALLOC(length + 1);
+    memcpy(cache->directory, directory, length + 1);
+    cache->maxBytes = maxBytes;
+    TokenCacheEntryArray entries;
+    ListTokenCache(cache, &entries);
+    for (uint64_t i = 0; i < entries.size; i++)
+        cache->bytes += entries.arr[i].size;
+    FREE_ARRAY(entries)
+    // The directory must be usable, try to create a file in it
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/.toka-cache", directory);
+    FILE *probe = fopen(path, "wb");
+    if (probe == NULL)
+    {
+        CloseTokenCache(cache);
+        return false;
+    }
+    fclose(probe);
+    remove(path);
+    if ((cache->maxBytes > 0) && (cache->bytes > cache->maxBytes))
+        EvictTokenCache(cache);
+    return true;
+}
+
+/** @brief Hash of size bytes of data, 8 bytes at a time
+    @note Not cryptographic, it only has to tell different files apart
+*/
+inline uint64_t HashBytes(const void *data, uint64_t size, uint64_t seed)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t hash = seed ^ (size * 0x9E3779B97F4A7C15ULL);
+    uint64_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t value;
+        memcpy(&value, p + i, 8);
+        value *= 0xBF58476D1CE4E5B9ULL;
+        value ^= value >> 31;
+        hash = (hash ^ value) * 0x94D049BB133111EBULL;
+        hash = (hash << 27) | (hash >> 37);
+    }
+    uint64_t tail = 0;
+    for (uint64_t k = 0; i + k < size; k++)
+        tail |= (uint64_t)p[i + k] << (8 * k);
+    hash = (hash ^ (tail * 0xBF58476D1CE4E5B9ULL)) * 0x94D049BB133111EBULL;
+    // splitmix64 finalizer so every input bit reaches every output bit
+    hash ^= hash >> 30;
+    hash *= 0xBF58476D1CE4E5B9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94D049BB133111EBULL;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+/** @brief Hashes what decides the tokens apart from the input
+    @note Rules are identified by their name and id since function pointers change between
+    builds, so rename a rule (or bump its name) when its function changes meaning
+*/
+inline uint64_t RuleFingerprint(const ParserContext *ctx)
+{
+    uint64_t header[3] = {TOKEN_FILE_VERSION, ctx->fileMode, ctx->rules.size};
+    uint64_t hash = HashBytes(header, sizeof(header), 0);
+    for (uint64_t i = 0; i < ctx->rules.size; i++)
+    {
+        const char *name = (ctx->rules.arr[i].name != NULL) ? ctx->rules.arr[i].name : "";
+        hash = HashBytes(name, strlen(name) + 1, hash ^ (uint64_t)ctx->rules.arr[i].id);
+    }
+    for (uint64_t i = 0; i < ctx->patterns.size; i++)
+    {
+        const TokenPattern *pattern = &ctx->patterns.arr[i];
+        hash = HashBytes(pattern->pattern, strlen(pattern->pattern) + 1, hash ^ (uint64_t)pattern->typeId);
+        if (pattern->type != NULL)
+            hash = HashBytes(pattern->type, strlen(pattern->type), hash);
+    }
+    for (uint64_t i = 0; i <= ctx->keywords.slotMask && (ctx->keywords.count > 0); i++)
+    {
+        const Keyword *keyword = &ctx->keywords.slots[i];
+        if (keyword->text != NULL)
+            hash = HashBytes(keyword->text, strlen(keyword->text) + 1, hash ^ (uint64_t)keyword->typeId);
+    }
+    // Contexts that drop some types store different tokens
+    if (ctx->filteringTypes)
+        hash = HashBytes(ctx->keepTypes, ctx->keepTypeWords * sizeof(uint64_t), hash ^ 1);
+    return hash;
+}
+
+// The cache's own copy of a type name, so loaded tokens don't point into an unmapped file
+inline char *CachedTypeName(TokenCache *cache, int typeId, const char *type)
+{
+    for (uint64_t k = 0; k < cache->typeNameCount; k++)
+    {
+        if ((cache->typeNames[k].typeId == typeId) && (strcmp(cache->typeNames[k].type, type) == 0))
+            return cache->typeNames[k].type;
+    }
+    char *copy = (char *)TOKA_MALLOC(strlen(type) + 1);
+    if (copy == NULL)
+        return NULL;
+    TokenTypeName *typeNames =
+        (TokenTypeName *)TOKA_REALLOC(cache->typeNames, (cache->typeNameCount + 1) * sizeof(TokenTypeName));
+    if (typeNames == NULL)
+    {
+        TOKA_FREE(copy);
+        return NULL;
+    }
+    strcpy(copy, type);
+    cache->typeNames = typeNames;
+    TokenTypeName *name = &cache->typeNames[cache->typeNameCount++];
+    name->typeId = typeId;
+    name->type = copy;
+    return copy;
+}
+
+inline bool LoadCachedTokens(TokenCache *cache, ParserContext *ctx, const char *path)
+{
+    TokenFileReader reader;
+    if (!OpenTokenFile(&reader, path))
+        return false;
+    if (!(reader.flags & TOKEN_FILE_HAS_TEXT))
+    {
+        CloseTokenFile(&reader);
+        return false;
+    }
+    // The decoded tokens get the cache's copies of the type names
+    bool named = true;
+    for (uint32_t k = 0; named && (k < reader.typeCount); k++)
+    {
+        reader.types[k].type = CachedTypeName(cache, reader.types[k].typeId, reader.types[k].type);
+        named = (reader.types[k].type != NULL);
+    }
+    if (!named)
+    {
+        CloseTokenFile(&reader);
+        return false;
+    }
+    uint64_t tokenCount = ctx->tokens.size;
+    // Stays true when every record decodes and has its text in the pool
+    bool complete = true;
+    Token t;
+    while (NextStoredToken(&reader, &t))
+    {
+        if (t.value.arr == NULL)
+        {
+            complete = false;
+            break;
+        }
+        const char *text = t.value.arr;
+        uint64_t length = t.value.size - 1;
+        t.priorReach = 0;
+        if (ctx->spanTokens && !ctx->fileMode)
+        {
+            INIT_ARRAY(char, t.value, 0);
+            t.symbol = ctx->interning ? InternText(&ctx->interner, text, length) : 0;
+            APPEND_TO_ARRAY(Token, ctx->tokens, t)
+        }
+        else
+        {
+            SetTokenValue(ctx, &t, text, length);
+            APPEND_TO_ARRAY(Token, ctx->tokens, t)
+        }
+    }
+    // A record that doesn't decode stops the reader early, the entry is corrupt
+    complete = complete && (reader.next == reader.tokenCount);
+    uint64_t entrySize = reader.file.size;
+    CloseTokenFile(&reader);
+    if (!complete)
+    {
+        while (ctx->tokens.size > tokenCount)
+        {
+            ctx->tokens.size--;
+            if (!ctx->useArena)
+                FREE_ARRAY(ctx->tokens.arr[ctx->tokens.size].value)
+        }
+        if (remove(path) == 0)
+            cache->bytes -= (entrySize < cache->bytes) ? entrySize : cache->bytes;
+    }
+    return complete;
+}
+
+/** @brief Tokenizes the file at path through the cache
+    @note String mode contexts get the file mapped as with ParseMappedFile, file mode contexts
+    parse it with Parse. The content is hashed together with RuleFingerprint(ctx): if a token file
+    with that key exists its tokens are loaded instead of running the rules, otherwise the file is
+    parsed and its tokens stored. ctx should have no tokens yet (the cache stores all of them),
+    if it has some the file is parsed without the cache. An entry that turns out to be corrupt is
+    removed, counted as a miss and replaced. Tokens loaded from the cache don't know
+    what their rules read, so don't Retokenize them
+*/
+inline bool CachedParse(TokenCache *cache, ParserContext *ctx, char *path)
+{
+    MappedFile content;
+    if (!MapFile(path, &content))
+        return false;
+    // A counting context has no tokens to store
+    bool cacheable = (ctx->tokens.size == 0) && !ctx->countingTypes;
+    char entryPath[4096];
+    snprintf(entryPath, sizeof(entryPath), "%s/%016llx-%016llx-%llx.tok", cache->directory,
+             (unsigned long long)HashBytes(content.data, content.size, 0),
+             (unsigned long long)RuleFingerprint(ctx), (unsigned long long)content.size);
+    bool hit = cacheable && LoadCachedTokens(cache, ctx, entryPath);
+    if (hit)
+    {
+        cache->hits++;
+        // Keeps the most recently used entries out of the eviction
+#if defined(_WIN32)
+        _utime(entryPath, NULL);
+#elif defined(TOKA_HAS_MMAP)
+        utime(entryPath, NULL);
+#endif
+    }
+    else
+        cache->misses++;
+    if (ctx->fileMode)
+    {
+        UnmapFile(&content);
+        if (!hit && !Parse(ctx, path))
+            return false;
+    }
+    else
+    {
+        UnmapFile(&ctx->sourceFile);
+        ctx->sourceFile = content;
+        ctx->source = content.data;
+        ctx->sourceSize = content.size;
+        ctx->cursorOffset = 0;
+        if (hit)
+        {
+            ctx->cursorOffset = content.size;
+            ctx->furthestRead = content.size;
+        }
+        else
+            ParseBuffer(ctx);
+    }
+    if (hit || !cacheable)
+        return true;
+    // Written under another name first so a reader never sees half a file
+    char temporaryPath[4096 + 8];
+    snprintf(temporaryPath, sizeof(temporaryPath), "%s.tmp", entryPath);
+    if (WriteTokenFile(ctx, temporaryPath, true))
+    {
+        remove(entryPath);
+        if (rename(temporaryPath, entryPath) == 0)
+        {
+            FILE *entry = fopen(entryPath, "rb");
+            if (entry != NULL)
+            {
+                fseek(entry, 0, SEEK_END);
+                cache->bytes += ftell(entry);
+                fclose(entry);
+            }
+            cache->stores++;
+            if ((cache->maxBytes > 0) && (cache->bytes > cache->maxBytes))
+                EvictTokenCache(cache);
+        }
+    }
+    remove(temporaryPath);
+    return true;
+}
+
+// Removes the least recently used entries until the cache fits in maxBytes
+inline void EvictTokenCache(TokenCache *cache)
+{
+    TokenCacheEntryArray entries;
+    ListTokenCache(cache, &entries);
+    cache->bytes = 0;
+    for (uint64_t i = 0; i < entries.size; i++)
+        cache->bytes += entries.arr[i].size;
+    while ((cache->bytes > cache->maxBytes) && (entries.size > 0))
+    {
+        uint64_t oldest = 0;
+        for (uint64_t i = 1; i < entries.size; i++)
+        {
+            if (entries.arr[i].modified < entries.arr[oldest].modified)
+                oldest = i;
+        }
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", cache->directory, entries.arr[oldest].name);
+        if (remove(path) == 0)
+        {
+            cache->bytes -= entries.arr[oldest].size;
+            cache->evictions++;
+        }
+        entries.arr[oldest] = entries.arr[--entries.size];
+    }
+    FREE_ARRAY(entries)
+}
+
+inline void PrintTokenCacheStats(const TokenCache *cache, FILE *out)
+{
+    uint64_t lookups = cache->hits + cache->misses;
+    fprintf(out, "token cache %s: %llu hits, %llu misses (%.1f%% hit rate), %llu stores, %llu evictions, %.1f MB\n",
+            cache->directory, (unsigned long long)cache->hits, (unsigned long long)cache->misses,
+            (lookups > 0) ? 100.0 * cache->hits / lookups : 0.0, (unsigned long long)cache->stores,
+            (unsigned long long)cache->evictions, cache->bytes / (1024.0 * 1024.0));
+}
+
+inline void CloseTokenCache(TokenCache *cache)
+{
+    for (uint64_t k = 0; k < cache->typeNameCount; k++)
+        TOKA_FREE(cache->typeNames[k].type);
+    TOKA_FREE(cache->typeNames);
+    TOKA_FREE(cache->directory);
+    memset(cache, 0, sizeof(TokenCache));
+}
+/////////////////////TOKEN CACHE END///////////////////////
+
+/** @brief Interns the values of the tokens of the context
+    @note Values made by AppendToken, AppendTokenText or SetTokenValue point to the interner's
+    single copy of their text (don't modify them) and tokens get its symbol id, span tokens only
+    get the id. Comparing two token texts is then comparing their symbols. The interner keeps
+    its texts across ResetContext, a clone gets its own interner so ids are per context
+*/
+inline void UseInterner(ParserContext *ctx)
+{
+    if (!ctx->interning)
+        ctx->interner = CreateInterner();
+    ctx->interning = true;
+}
+
+inline Interner CreateInterner(void)
+{
+    Interner interner;
+    INIT_ARRAY(Symbol, interner.symbols, 0);
+    interner.slotMask = 1023;
+    interner.slots = (uint32_t *)TOKA_CALLOC(interner.slotMask + 1, sizeof(uint32_t));
+    interner.text = CreateArena(64 * 1024);
+    return interner;
+}
+
+inline uint32_t InternText(Interner *interner, const char *text, uint64_t length)
+{
+    uint32_t hash = (uint32_t)HashBytes(text, length, 0);
+    uint64_t slot = hash & interner->slotMask;
+    while (interner->slots[slot] != 0)
+    {
+        const Symbol *symbol = &interner->symbols.arr[interner->slots[slot] - 1];
+        if ((symbol->hash == hash) && (symbol->length == length) && (memcmp(symbol->text, text, length) == 0))
+            return interner->slots[slot];
+        slot = (slot + 1) & interner->slotMask;
+    }
+    char *copy = (char *)ArenaAlloc(&interner->text, length + 1);
+    if (copy == NULL)
+        return 0;
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    Symbol symbol = {copy, (uint32_t)length, hash};
+    APPEND_TO_ARRAY(Symbol, interner->symbols, symbol)
+    interner->slots[slot] = (uint32_t)interner->symbols.size;
+    if ((interner->symbols.size + 1) * 2 > interner->slotMask + 1)
+        GrowInterner(interner);
+    return (uint32_t)interner->symbols.size;
+}
+
+// Doubles the hash table, the stored hashes make it a reinsertion of the ids
+inline bool GrowInterner(Interner *interner)
+{
+    uint64_t slotMask = interner->slotMask * 2 + 1;
+    uint32_t *slots = (uint32_t *)TOKA_CALLOC(slotMask + 1, sizeof(uint32_t));
+    if (slots == NULL)
+        return false;
+    for (uint64_t i = 0; i < interner->symbols.size; i++)
+    {
+        uint64_t slot = interner->symbols.arr[i].hash & slotMask;
+        while (slots[slot] != 0)
+            slot = (slot + 1) & slotMask;
+        slots[slot] = (uint32_t)(i + 1);
+    }
+    TOKA_FREE(interner->slots);
+    interner->slots = slots;
+    interner->slotMask = slotMask;
+    return true;
+}
+
+inline uint32_t FindSymbol(const Interner *interner, const char *text, uint64_t length)
+{
+    uint32_t hash = (uint32_t)HashBytes(text, length, 0);
+    for (uint64_t slot = hash & interner->slotMask; interner->slots[slot] != 0;
+         slot = (slot + 1) & interner->slotMask)
+    {
+        const Symbol *symbol = &interner->symbols.arr[interner->slots[slot] - 1];
+        if ((symbol->hash == hash) && (symbol->length == length) && (memcmp(symbol->text, text, length) == 0))
+            return interner->slots[slot];
+    }
+    return 0;
+}
+
+inline const char *SymbolText(const Interner *interner, uint32_t symbol)
+{
+    if ((symbol == 0) || (symbol > interner->symbols.size))
+        return NULL;
+    return interner->symbols.arr[symbol - 1].text;
+}
+
+inline uint32_t SymbolLength(const Interner *interner, uint32_t symbol)
+{
+    if ((symbol == 0) || (symbol > interner->symbols.size))
+        return 0;
+    return interner->symbols.arr[symbol - 1].length;
+}
+
+inline void FreeInterner(Interner *interner)
+{
+    FREE_ARRAY(interner->symbols)
+    TOKA_FREE(interner->slots);
+    interner->slots = NULL;
+    FreeArena(&interner->text);
+}
+
+/** @brief Token values get allocated from an arena owned by the context
+    @note Resetting the context then rewinds the arena instead of freeing every token and keeps
+    the token array's memory around. Rules have to create their values through AppendToken,
+    AppendTokenText or SetTokenValue for this to work
+*/
+inline void UseTokenArena(ParserContext *ctx, uint64_t blockSize)
+{
+    if (!ctx->useArena)
+        ctx->arena = CreateArena(blockSize);
+    ctx->useArena = true;
+}
+
+inline Arena CreateArena(uint64_t blockSize)
+{
+    Arena arena;
+    arena.first = NULL;
+    arena.current = NULL;
+    arena.blockSize = (blockSize > 0) ? blockSize : 64 * 1024;
+    return arena;
+}
+
+inline void *ArenaAlloc(Arena *arena, uint64_t size)
+{
+    size = (size + 7) & ~(uint64_t)7;
+    ArenaBlock *block = arena->current;
+    if ((block == NULL) || (block->used + size > block->size))
+    {
+        // Reuse the next block from before the last reset if it is big enough
+        if ((block != NULL) && (block->next != NULL) && (block->next->size >= size))
+        {
+            block = block->next;
+            block->used = 0;
+        }
+        else
+        {
+            uint64_t blockSize = (size > arena->blockSize) ? size : arena->blockSize;
+            ArenaBlock *newBlock = (ArenaBlock *)TOKA_MALLOC(sizeof(ArenaBlock) + blockSize);
+            newBlock->size = blockSize;
+            newBlock->used = 0;
+            if (block == NULL)
+            {
+                newBlock->next = arena->first;
+                arena->first = newBlock;
+            }
+            else
+            {
+                newBlock->next = block->next;
+                block->next = newBlock;
+            }
+            block = newBlock;
+        }
+        arena->current = block;
+    }
+    void *memory = (char *)(block + 1) + block->used;
+    block->used += size;
+    return memory;
+}
+
+inline void ArenaReset(Arena *arena)
+{
+    arena->current = arena->first;
+    if (arena->first != NULL)
+        arena->first->used = 0;
+}
+
+inline void FreeArena(Arena *arena)
+{
+    ArenaBlock *block = arena->first;
+    while (block != NULL)
+    {
+        ArenaBlock *next = block->next;
+        TOKA_FREE(block);
+        block = next;
+    }
+    arena->first = NULL;
+    arena->current = NULL;
+}
+
+inline CharClass CharClassRange(char first, char last)
+{
+    CharClass charClass;
+    memset(&charClass, 0, sizeof(CharClass));
+    for (int c = (unsigned char)first; c <= (unsigned char)last; c++)
+        charClass.bits[c >> 6] |= (uint64_t)1 << (c & 63);
+    UpdateCharClassTables(&charClass);
+    return charClass;
+}
+
+inline CharClass CharClassSet(const char *chars)
+{
+    CharClass charClass;
+    memset(&charClass, 0, sizeof(CharClass));
+    for (; *chars != '\0'; chars++)
+        charClass.bits[(unsigned char)*chars >> 6] |= (uint64_t)1 << ((unsigned char)*chars & 63);
+    UpdateCharClassTables(&charClass);
+    return charClass;
+}
+
+inline CharClass CharClassUnion(CharClass a, CharClass b)
+{
+    for (int i = 0; i < 4; i++)
+        a.bits[i] |= b.bits[i];
+    UpdateCharClassTables(&a);
+    return a;
+}
+
+inline CharClass CharClassDifference(CharClass a, CharClass b)
+{
+    for (int i = 0; i < 4; i++)
+        a.bits[i] &= ~b.bits[i];
+    UpdateCharClassTables(&a);
+    return a;
+}
+
+inline CharClass CharClassFromCondition(ParsingCondition condition)
+{
+    CharClass charClass;
+    memset(&charClass, 0, sizeof(CharClass));
+    for (int c = 0; c < 256; c++)
+    {
+        if (condition((char)c))
+            charClass.bits[c >> 6] |= (uint64_t)1 << (c & 63);
+    }
+    UpdateCharClassTables(&charClass);
+    return charClass;
+}
+
+inline bool InCharClass(const CharClass *charClass, char c)
+{
+    return CHAR_CLASS_HAS(*charClass, c);
+}
+
+inline void UpdateCharClassTables(CharClass *charClass)
+{
+    memset(charClass->nibbleRows, 0, sizeof(charClass->nibbleRows));
+    for (int c = 0; c < 256; c++)
+    {
+        if (CHAR_CLASS_HAS(*charClass, c))
+            charClass->nibbleRows[c >> 7][c & 15] |= (uint8_t)(1 << ((c >> 4) & 7));
+    }
+}
+
+inline uint32_t CountTrailingZeros(uint32_t mask)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return (uint32_t)__builtin_ctz(mask);
+#else
+    uint32_t count = 0;
+    while ((mask & 1) == 0)
+    {
+        mask >>= 1;
+        count++;
+    }
+    return count;
+#endif
+}
+
+inline uint32_t CountBits(uint32_t mask)
+{
+    mask = mask - ((mask >> 1) & 0x55555555u);
+    mask = (mask & 0x33333333u) + ((mask >> 2) & 0x33333333u);
+    return (((mask + (mask >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24;
+}
+
+inline int SimdLevel(void)
+{
+#if defined(TOKA_SIMD_SSE2)
+    int level = 1;
+#else
+    int level = 0;
+#endif
+#if defined(TOKA_SIMD_AVX2)
+    // Only AVX2 needs asking the CPU, done once since the scans call this for every buffer. The
+    // cache is atomic as the scans run on the worker threads of ParseFiles and ParseBufferParallel
+    static int cached = -1;
+    int known = __atomic_load_n(&cached, __ATOMIC_RELAXED);
+    if (known >= 0)
+        return known;
+    if (__builtin_cpu_supports("avx2"))
+        level = 2;
+    __atomic_store_n(&cached, level, __ATOMIC_RELAXED);
+#endif
+    return level;
+}
+
+#if defined(TOKA_SIMD_AVX2)
+/** @brief Tests 32 bytes against a class at once: the low nibble of every byte picks a row of
+    nibbleRows (the first or second table depending on the top bit) and the high nibble picks the
+    bit in that row
+    @return A mask with bit i set if v[i] is NOT in the class
+*/
+__attribute__((target("avx2"))) inline uint32_t CharClassMissMaskAVX2(__m256i v, __m256i rowsLow, __m256i rowsHigh,
+                                                                     __m256i rowBits)
+{
+    __m256i nibbleMask = _mm256_set1_epi8(0x0F);
+    __m256i low = _mm256_and_si256(v, nibbleMask);
+    __m256i high = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibbleMask);
+    __m256i row = _mm256_blendv_epi8(_mm256_shuffle_epi8(rowsLow, low), _mm256_shuffle_epi8(rowsHigh, low), v);
+    __m256i hit = _mm256_and_si256(row, _mm256_shuffle_epi8(rowBits, high));
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hit, _mm256_setzero_si256()));
+}
+
+__attribute__((target("avx2"))) inline uint64_t SkipCharClassAVX2(const char *buffer, uint64_t pos, uint64_t end,
+                                                                 const CharClass *charClass)
+{
+    __m256i rowsLow = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)charClass->nibbleRows[0]));
+    __m256i rowsHigh = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)charClass->nibbleRows[1]));
+    __m256i rowBits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 1, 2, 4, 8, 16, 32, 64, (char)128,
+                                       1, 2, 4, 8, 16, 32, 64, (char)128, 1, 2, 4, 8, 16, 32, 64, (char)128);
+    for (; pos + 32 <= end; pos += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buffer + pos));
+        uint32_t miss = CharClassMissMaskAVX2(v, rowsLow, rowsHigh, rowBits);
+        if (miss != 0)
+            return pos + CountTrailingZeros(miss);
+    }
+    for (; pos < end; pos++)
+    {
+        if (!CHAR_CLASS_HAS(*charClass, buffer[pos]))
+            return pos;
+    }
+    return end;
+}
+
+__attribute__((target("avx2"))) inline uint64_t FindFirstOfAVX2(const char *buffer, uint64_t pos, uint64_t end,
+                                                               const char *set, int setSize)
+{
+    __m256i s0 = _mm256_set1_epi8(set[0]);
+    __m256i s1 = _mm256_set1_epi8(set[(setSize > 1) ? 1 : 0]);
+    __m256i s2 = _mm256_set1_epi8(set[(setSize > 2) ? 2 : 0]);
+    __m256i s3 = _mm256_set1_epi8(set[(setSize > 3) ? 3 : 0]);
+    for (; pos + 32 <= end; pos += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buffer + pos));
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, s0), _mm256_cmpeq_epi8(v, s1)),
+                                      _mm256_or_si256(_mm256_cmpeq_epi8(v, s2), _mm256_cmpeq_epi8(v, s3)));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(hit);
+        if (mask != 0)
+            return pos + CountTrailingZeros(mask);
+    }
+    return pos;
+}
+
+__attribute__((target("avx2"))) inline uint64_t CountNewlinesAVX2(const char *buffer, uint64_t *pos, uint64_t end)
+{
+    uint64_t count = 0;
+    __m256i newline = _mm256_set1_epi8('\n');
+    for (; *pos + 32 <= end; *pos += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buffer + *pos));
+        count += CountBits((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline)));
+    }
+    return count;
+}
+
+__attribute__((target("avx2"))) inline uint64_t FindNewlinesAVX2(const char *buffer, uint64_t *pos, uint64_t end,
+                                                                uint64_t *offsets)
+{
+    uint64_t count = 0;
+    __m256i newline = _mm256_set1_epi8('\n');
+    for (; *pos + 32 <= end; *pos += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buffer + *pos));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline));
+        // One iteration per newline, clearing the lowest set bit each time
+        for (; mask != 0; mask &= mask - 1)
+            offsets[count++] = *pos + CountTrailingZeros(mask);
+    }
+    return count;
+}
+#endif
+
+inline uint64_t SkipCharClass(const char *buffer, uint64_t pos, uint64_t end, const CharClass *charClass)
+{
+    // Most runs (identifiers, spaces) are short, the first bytes are tested before setting up vectors
+    uint64_t start = pos;
+    for (; (pos < end) && (pos - start < 16); pos++)
+    {
+        if (!CHAR_CLASS_HAS(*charClass, buffer[pos]))
+            return pos;
+    }
+#if defined(TOKA_SIMD_AVX2)
+    if (SimdLevel() == 2)
+        return SkipCharClassAVX2(buffer, pos, end, charClass);
+#endif
+    // SSE2 has no byte shuffle to look the class up with, so anything else tests one byte at a time
+    for (; pos < end; pos++)
+    {
+        if (!CHAR_CLASS_HAS(*charClass, buffer[pos]))
+            return pos;
+    }
+    return end;
+}
+
+inline uint64_t FindFirstOf(const char *buffer, uint64_t pos, uint64_t end, const char *set, int setSize)
+{
+    int level = SimdLevel();
+#if defined(TOKA_SIMD_AVX2)
+    if (level == 2)
+        pos = FindFirstOfAVX2(buffer, pos, end, set, setSize);
+#endif
+#if defined(TOKA_SIMD_SSE2)
+    if (level >= 1)
+    {
+        __m128i s0 = _mm_set1_epi8(set[0]);
+        __m128i s1 = _mm_set1_epi8(set[(setSize > 1) ? 1 : 0]);
+        __m128i s2 = _mm_set1_epi8(set[(setSize > 2) ? 2 : 0]);
+        __m128i s3 = _mm_set1_epi8(set[(setSize > 3) ? 3 : 0]);
+        for (; pos + 16 <= end; pos += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(buffer + pos));
+            __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, s0), _mm_cmpeq_epi8(v, s1)),
+                                       _mm_or_si128(_mm_cmpeq_epi8(v, s2), _mm_cmpeq_epi8(v, s3)));
+            uint32_t mask = (uint32_t)_mm_movemask_epi8(hit);
+            if (mask != 0)
+                return pos + CountTrailingZeros(mask);
+        }
+    }
+#endif
+    (void)level;
+    for (; pos < end; pos++)
+    {
+        for (int i = 0; i < setSize; i++)
+        {
+            if (buffer[pos] == set[i])
+                return pos;
+        }
+    }
+    return end;
+}
+
+inline uint64_t CountNewlines(const char *buffer, uint64_t pos, uint64_t end)
+{
+    uint64_t count = 0;
+    int level = SimdLevel();
+#if defined(TOKA_SIMD_AVX2)
+    if (level == 2)
+        count += CountNewlinesAVX2(buffer, &pos, end);
+#endif
+#if defined(TOKA_SIMD_SSE2)
+    if (level >= 1)
+    {
+        __m128i newline = _mm_set1_epi8('\n');
+        for (; pos + 16 <= end; pos += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(buffer + pos));
+            count += CountBits((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline)));
+        }
+    }
+#endif
+    (void)level;
+    for (; pos < end; pos++)
+        count += (buffer[pos] == '\n');
+    return count;
+}
+
+inline uint64_t FindNewlines(const char *buffer, uint64_t pos, uint64_t end, uint64_t *offsets)
+{
+    uint64_t count = 0;
+    int level = SimdLevel();
+#if defined(TOKA_SIMD_AVX2)
+    if (level == 2)
+        count += FindNewlinesAVX2(buffer, &pos, end, offsets);
+#endif
+#if defined(TOKA_SIMD_SSE2)
+    if (level >= 1)
+    {
+        __m128i newline = _mm_set1_epi8('\n');
+        for (; pos + 16 <= end; pos += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(buffer + pos));
+            uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+            for (; mask != 0; mask &= mask - 1)
+                offsets[count++] = pos + CountTrailingZeros(mask);
+        }
+    }
+#endif
+    (void)level;
+    for (; pos < end; pos++)
+    {
+        if (buffer[pos] == '\n')
+            offsets[count++] = pos;
+    }
+    return count;
+}
+
+/** @brief Turns the lazy positions on or off
+    @note With lazy positions the engine only tracks byte offsets, the line and at that rules
+    store in their tokens are meaningless (rules may check ctx->lazyPositions and skip
+    computing them). The positions are computed when asked for from an index of the newlines
+    of the source, built once with a vectorized scan. Only for string and mapped mode
+*/
+inline void UseLazyPositions(ParserContext *ctx, bool lazy)
+{
+    ctx->lazyPositions = lazy;
+}
+
+inline void BuildNewlineIndex(ParserContext *ctx)
+{
+    FREE_ARRAY(ctx->newlines)
+    uint64_t count = (ctx->source != NULL) ? CountNewlines(ctx->source, 0, ctx->sourceSize) : 0;
+    INIT_ARRAY(uint64_t, ctx->newlines, count + 1);
+    if (ctx->source != NULL)
+        ctx->newlines.size = FindNewlines(ctx->source, 0, ctx->sourceSize, ctx->newlines.arr);
+    ctx->newlinesSource = ctx->source;
+    ctx->newlinesSize = ctx->sourceSize;
+}
+
+inline void OffsetPosition(ParserContext *ctx, uint64_t offset, long *line, long *at)
+{
+    if ((ctx->newlines.arr == NULL) || (ctx->newlinesSource != ctx->source) || (ctx->newlinesSize != ctx->sourceSize))
+        BuildNewlineIndex(ctx);
+    // Number of newlines before offset
+    uint64_t low = 0, high = ctx->newlines.size;
+    while (low < high)
+    {
+        uint64_t middle = low + (high - low) / 2;
+        if (ctx->newlines.arr[middle] < offset)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    uint64_t lineStart = (low > 0) ? ctx->newlines.arr[low - 1] + 1 : 0;
+    *line = (long)low + 1;
+    *at = (long)(offset - lineStart) + 1;
+}
+
+inline long TokenLine(ParserContext *ctx, Token *t)
+{
+    if (!ctx->lazyPositions || (ctx->source == NULL))
+        return t->line;
+    long line, at;
+    OffsetPosition(ctx, t->offset, &line, &at);
+    return line;
+}
+
+inline long TokenColumn(ParserContext *ctx, Token *t)
+{
+    if (!ctx->lazyPositions || (ctx->source == NULL))
+        return t->at;
+    long line, at;
+    OffsetPosition(ctx, t->offset, &line, &at);
+    return at;
+}
+
+// Tokens come in source order, so one walk over the newlines replaces a search per token
+inline void ResolveTokenPositions(ParserContext *ctx)
+{
+    if (ctx->source == NULL)
+        return;
+    if ((ctx->newlines.arr == NULL) || (ctx->newlinesSource != ctx->source) || (ctx->newlinesSize != ctx->sourceSize))
+        BuildNewlineIndex(ctx);
+    uint64_t k = 0;
+    for (uint64_t i = 0; i < ctx->tokens.size; i++)
+    {
+        Token *t = &ctx->tokens.arr[i];
+        if ((k > 0) && (ctx->newlines.arr[k - 1] >= t->offset))
+        {
+            OffsetPosition(ctx, t->offset, &t->line, &t->at);
+            continue;
+        }
+        while ((k < ctx->newlines.size) && (ctx->newlines.arr[k] < t->offset))
+            k++;
+        uint64_t lineStart = (k > 0) ? ctx->newlines.arr[k - 1] + 1 : 0;
+        t->line = (long)k + 1;
+        t->at = (long)(t->offset - lineStart) + 1;
+    }
+}
+
+inline bool SetKeywords(ParserContext *ctx, const Keyword *keywords, uint64_t count)
+{
+    FreeKeywordTable(&ctx->keywords);
+    return BuildKeywordTable(&ctx->keywords, keywords, count);
+}
+
+inline bool ClassifyKeyword(const KeywordTable *table, Token *t, const char *text, uint64_t length)
+{
+    const Keyword *keyword = FindKeyword(table, text, length);
+    if (keyword == NULL)
+        return false;
+    t->typeId = keyword->typeId;
+    t->type = (char *)keyword->name;
+    return true;
+}
+
+// FNV-1a of text[0, length) started from a seed, with a final mix so the low bits depend on every byte
+inline uint32_t HashKeyword(uint32_t seed, const char *text, uint64_t length)
+{
+    uint32_t hash = 2166136261u ^ seed;
+    for (uint64_t i = 0; i < length; i++)
+        hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+    hash ^= hash >> 15;
+    hash *= 0x2c1b3c6du;
+    hash ^= hash >> 12;
+    return hash;
+}
+
+/** @brief Builds a table where every keyword gets its own slot
+    @note Seeds are tried until one places every keyword in a different slot, the table
+    doubles in size every few hundred failed seeds. Returns false if two keywords are equal or an
+    allocation fails, the table is then left empty
+*/
+inline bool BuildKeywordTable(KeywordTable *table, const Keyword *keywords, uint64_t count)
+{
+    memset(table, 0, sizeof(KeywordTable));
+    uint64_t minLength = UINT64_MAX, maxLength = 0;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        uint64_t length = strlen(keywords[i].text);
+        if (length < minLength)
+            minLength = length;
+        if (length > maxLength)
+            maxLength = length;
+        for (uint64_t j = 0; j < i; j++)
+        {
+            if (strcmp(keywords[i].text, keywords[j].text) == 0)
+                return false;
+        }
+    }
+    uint64_t slotCount = 8;
+    while (slotCount < count * 2)
+        slotCount *= 2;
+    while (true)
+    {
+        table->slots = (Keyword *)TOKA_CALLOC(slotCount, sizeof(Keyword));
+        table->slotLengths = (uint32_t *)TOKA_CALLOC(slotCount, sizeof(uint32_t));
+        if ((table->slots == NULL) || (table->slotLengths == NULL))
+        {
+            FreeKeywordTable(table);
+            return false;
+        }
+        table->slotMask = (uint32_t)(slotCount - 1);
+        for (uint32_t seed = 0; seed < 256; seed++)
+        {
+            bool collision = false;
+            for (uint64_t i = 0; (i < count) && !collision; i++)
+            {
+                uint64_t length = strlen(keywords[i].text);
+                uint32_t slot = HashKeyword(seed, keywords[i].text, length) & table->slotMask;
+                if (table->slots[slot].text != NULL)
+                    collision = true;
+                else
+                {
+                    table->slots[slot] = keywords[i];
+                    table->slotLengths[slot] = (uint32_t)length;
+                }
+            }
+            if (!collision)
+            {
+                table->seed = seed;
+                table->count = count;
+                table->minLength = minLength;
+                table->maxLength = maxLength;
+                return true;
+            }
+            memset(table->slots, 0, slotCount * sizeof(Keyword));
+        }
+        TOKA_FREE(table->slots);
+        TOKA_FREE(table->slotLengths);
+        slotCount *= 2;
+    }
+}
+
+inline const Keyword *FindKeyword(const KeywordTable *table, const char *text, uint64_t length)
+{
+    if ((table->count == 0) || (length < table->minLength) || (length > table->maxLength))
+        return NULL;
+    uint32_t slot = HashKeyword(table->seed, text, length) & table->slotMask;
+    const Keyword *keyword = &table->slots[slot];
+    if ((keyword->text == NULL) || (table->slotLengths[slot] != length) ||
+        (memcmp(keyword->text, text, length) != 0))
+        return NULL;
+    return keyword;
+}
+
+inline void FreeKeywordTable(KeywordTable *table)
+{
+    TOKA_FREE(table->slots);
+    TOKA_FREE(table->slotLengths);
+    memset(table, 0, sizeof(KeywordTable));
+}
+
+/** @brief Runs the DFA from the cursor and turns the longest match into a token
+    @note Ties are won by the pattern that was added first. Line and character numbers
+    follow the newlines inside the match
+*/
+inline bool MatchPatterns(ParserContext *ctx)
+{
+    const PatternLexer *lexer = &ctx->lexer;
+    const char *src = ctx->source;
+    uint64_t start = ctx->cursorOffset, pos = start, end = ctx->sourceSize, matchEnd = start;
+    uint32_t state = lexer->start;
+    int32_t pattern = -1;
+    while (pos < end)
+    {
+        state = lexer->transitions[state * lexer->classCount + lexer->byteClasses[(unsigned char)src[pos]]];
+        if (state == 0)
+            break;
+        pos++;
+        if (lexer->accepts[state] >= 0)
+        {
+            pattern = lexer->accepts[state];
+            matchEnd = pos;
+        }
+    }
+    // The byte that stopped the DFA was read too
+    NOTE_READ(ctx, pos)
+    if (matchEnd == start)
+        return false;
+    const TokenPattern *tokenPattern = &ctx->patterns.arr[pattern];
+    if (tokenPattern->type != NULL)
+    {
+        Token t;
+        t.typeId = tokenPattern->typeId;
+        t.type = tokenPattern->type;
+        t.line = ctx->lineNumber;
+        t.at = ctx->charNumber;
+        AppendToken(ctx, t, start, matchEnd - start);
+    }
+    uint64_t newlines = ctx->lazyPositions ? 0 : CountNewlines(src, start, matchEnd);
+    if (newlines > 0)
+    {
+        uint64_t lineStart = matchEnd;
+        while (src[lineStart - 1] != '\n')
+            lineStart--;
+        ctx->lineNumber += newlines;
+        ctx->charNumber = 1 + (matchEnd - lineStart);
+    }
+    else
+        ctx->charNumber += matchEnd - start;
+    ctx->cursorOffset = matchEnd;
+    return true;
+}
+
+inline int NewNfaState(NfaStateArray *nfa, int kind)
+{
+    NfaState state;
+    memset(&state, 0, sizeof(NfaState));
+    state.kind = kind;
+    state.out = -1;
+    state.out2 = -1;
+    APPEND_TO_ARRAY(NfaState, (*nfa), state)
+    return (int)nfa->size - 1;
+}
+
+/** @brief Parses a pattern into an NFA fragment going from start to the NFA_EPSILON state end
+    @note Syntax: literal characters, '.' (anything but a newline), [a-z_] and [^...] classes,
+    escapes (\n \t \r \0 \xHH, \d \w \s, or a backslash before any other character to match it
+    literally), grouping with (), alternation with | and the * + ? repetitions
+*/
+inline bool ParsePattern(const char *pattern, NfaStateArray *nfa, int *start, int *end)
+{
+    const char *p = pattern;
+    if (!ParsePatternAlternation(&p, nfa, start, end))
+        return false;
+    // A ')' without its '('
+    return *p == '\0';
+}
+
+inline bool ParsePatternAlternation(const char **p, NfaStateArray *nfa, int *start, int *end)
+{
+    if (!ParsePatternSequence(p, nfa, start, end))
+        return false;
+    while (**p == '|')
+    {
+        (*p)++;
+        int otherStart, otherEnd;
+        if (!ParsePatternSequence(p, nfa, &otherStart, &otherEnd))
+            return false;
+        int split = NewNfaState(nfa, NFA_SPLIT);
+        int join = NewNfaState(nfa, NFA_EPSILON);
+        nfa->arr[split].out = *start;
+        nfa->arr[split].out2 = otherStart;
+        nfa->arr[*end].out = join;
+        nfa->arr[otherEnd].out = join;
+        *start = split;
+        *end = join;
+    }
+    return true;
+}
+
+inline bool ParsePatternSequence(const char **p, NfaStateArray *nfa, int *start, int *end)
+{
+    // An empty sequence matches the empty string
+    *start = NewNfaState(nfa, NFA_EPSILON);
+    *end = *start;
+    while ((**p != '\0') && (**p != '|') && (**p != ')'))
+    {
+        int partStart, partEnd;
+        if (!ParsePatternRepeat(p, nfa, &partStart, &partEnd))
+            return false;
+        nfa->arr[*end].out = partStart;
+        *end = partEnd;
+    }
+    return true;
+}
+
+inline bool ParsePatternRepeat(const char **p, NfaStateArray *nfa, int *start, int *end)
+{
+    if (!ParsePatternAtom(p, nfa, start, end))
+        return false;
+    while ((**p == '*') || (**p == '+') || (**p == '?'))
+    {
+        char op = *(*p)++;
+        int split = NewNfaState(nfa, NFA_SPLIT);
+        int exit = NewNfaState(nfa, NFA_EPSILON);
+        nfa->arr[split].out = *start;
+        nfa->arr[split].out2 = exit;
+        if (op == '*')
+        {
+            nfa->arr[*end].out = split;
+            *start = split;
+        }
+        else if (op == '+')
+            nfa->arr[*end].out = split;
+        else
+        {
+            nfa->arr[*end].out = exit;
+            *start = split;
+        }
+        *end = exit;
+    }
+    return true;
+}
+
+inline bool ParsePatternAtom(const char **p, NfaStateArray *nfa, int *start, int *end)
+{
+    CharClass set;
+    char c = *(*p)++;
+    if (c == '(')
+    {
+        if (!ParsePatternAlternation(p, nfa, start, end) || (**p != ')'))
+            return false;
+        (*p)++;
+        return true;
+    }
+    else if (c == '[')
+    {
+        if (!ParsePatternClass(p, &set))
+            return false;
+    }
+    else if (c == '.')
+        set = CharClassDifference(CharClassRange('\x00', '\xff'), CharClassSet("\n"));
+    else if (c == '\\')
+    {
+        if (!ParsePatternEscape(p, &set))
+            return false;
+    }
+    else if ((c == '*') || (c == '+') || (c == '?') || (c == ']'))
+        return false;
+    else
+    {
+        char chars[2] = {c, '\0'};
+        set = CharClassSet(chars);
+    }
+    *start = NewNfaState(nfa, NFA_SET);
+    *end = NewNfaState(nfa, NFA_EPSILON);
+    nfa->arr[*start].set = set;
+    nfa->arr[*start].out = *end;
+    return true;
+}
+
+// Parses what follows a backslash into the set of characters it matches
+inline bool ParsePatternEscape(const char **p, CharClass *set)
+{
+    char c = *(*p)++;
+    char chars[2] = {c, '\0'};
+    switch (c)
+    {
+    case '\0':
+        return false;
+    case 'n':
+        chars[0] = '\n';
+        break;
+    case 't':
+        chars[0] = '\t';
+        break;
+    case 'r':
+        chars[0] = '\r';
+        break;
+    case '0':
+        *set = CharClassRange('\0', '\0');
+        return true;
+    case 'd':
+        *set = CharClassRange('0', '9');
+        return true;
+    case 'w':
+        *set = CharClassUnion(CharClassUnion(CharClassRange('a', 'z'), CharClassRange('A', 'Z')),
+                              CharClassUnion(CharClassRange('0', '9'), CharClassSet("_")));
+        return true;
+    case 's':
+        *set = CharClassSet(" \t\r\n\f\v");
+        return true;
+    case 'x':
+    {
+        int value = 0;
+        for (int i = 0; i < 2; i++)
+        {
+            char digit = *(*p)++;
+            if ((digit >= '0') && (digit <= '9'))
+                value = value * 16 + (digit - '0');
+            else if ((digit >= 'a') && (digit <= 'f'))
+                value = value * 16 + (digit - 'a' + 10);
+            else if ((digit >= 'A') && (digit <= 'F'))
+                value = value * 16 + (digit - 'A' + 10);
+            else
+                return false;
+        }
+        *set = CharClassRange((char)value, (char)value);
+        return true;
+    }
+    }
+    *set = CharClassSet(chars);
+    return true;
+}
+
+// Parses the inside of [...] (after the '[') into a set
+inline bool ParsePatternClass(const char **p, CharClass *set)
+{
+    bool negate = (**p == '^');
+    if (negate)
+        (*p)++;
+    memset(set, 0, sizeof(CharClass));
+    while (**p != ']')
+    {
+        CharClass item;
+        char first = **p;
+        if (first == '\0')
+            return false;
+        (*p)++;
+        if (first == '\\')
+        {
+            if (!ParsePatternEscape(p, &item))
+                return false;
+            // Only single character escapes can start a range
+            uint64_t count = 0;
+            for (int c = 0; c < 256; c++)
+            {
+                if (CHAR_CLASS_HAS(item, c))
+                {
+                    count++;
+                    first = (char)c;
+                }
+            }
+            if (count != 1)
+            {
+                *set = CharClassUnion(*set, item);
+                continue;
+            }
+        }
+        if (((*p)[0] == '-') && ((*p)[1] != ']') && ((*p)[1] != '\0'))
+        {
+            (*p)++;
+            char last = *(*p)++;
+            if (last == '\\')
+            {
+                CharClass lastSet;
+                if (!ParsePatternEscape(p, &lastSet))
+                    return false;
+                for (int c = 0; c < 256; c++)
+                {
+                    if (CHAR_CLASS_HAS(lastSet, c))
+                        last = (char)c;
+                }
+            }
+            if ((unsigned char)last < (unsigned char)first)
+                return false;
+            *set = CharClassUnion(*set, CharClassRange(first, last));
+        }
+        else
+            *set = CharClassUnion(*set, CharClassRange(first, first));
+    }
+    (*p)++;
+    if (negate)
+        *set = CharClassDifference(CharClassRange('\x00', '\xff'), *set);
+    return true;
+}
+
+// Adds the states reachable from state without consuming a byte to list (members marks them)
+inline void NfaClosure(const NfaStateArray *nfa, int state, uint8_t *members, int *list, int *count)
+{
+    if ((state < 0) || members[state])
+        return;
+    members[state] = 1;
+    list[(*count)++] = state;
+    const NfaState *nfaState = &nfa->arr[state];
+    if ((nfaState->kind == NFA_EPSILON) || (nfaState->kind == NFA_SPLIT))
+    {
+        NfaClosure(nfa, nfaState->out, members, list, count);
+        NfaClosure(nfa, nfaState->out2, members, list, count);
+    }
+}
+
+/** @brief Builds the NFA of every pattern, turns it into a DFA by subset construction over the
+    byte classes and minimizes it by merging the states no input can tell apart
+*/
+inline void CompilePatterns(ParserContext *ctx)
+{
+    FreePatternLexer(&ctx->lexer);
+    PatternLexer *lexer = &ctx->lexer;
+    if (ctx->patterns.size == 0)
+        return;
+    NfaStateArray nfa;
+    INIT_ARRAY(NfaState, nfa, 64);
+    int nfaStart = -1;
+    for (uint64_t i = 0; i < ctx->patterns.size; i++)
+    {
+        int start, end;
+        ParsePattern(ctx->patterns.arr[i].pattern, &nfa, &start, &end);
+        int accept = NewNfaState(&nfa, NFA_ACCEPT);
+        nfa.arr[accept].pattern = (int)i;
+        nfa.arr[end].out = accept;
+        if (nfaStart < 0)
+            nfaStart = start;
+        else
+        {
+            int split = NewNfaState(&nfa, NFA_SPLIT);
+            nfa.arr[split].out = nfaStart;
+            nfa.arr[split].out2 = start;
+            nfaStart = split;
+        }
+    }
+    // Bytes that are in exactly the same sets end up in the same class
+    uint8_t representative[256];
+    memset(lexer->byteClasses, 0, sizeof(lexer->byteClasses));
+    lexer->classCount = 1;
+    for (uint64_t i = 0; i < nfa.size; i++)
+    {
+        if (nfa.arr[i].kind != NFA_SET)
+            continue;
+        int16_t split[256][2];
+        memset(split, -1, sizeof(split));
+        uint32_t classCount = 0;
+        uint8_t classes[256];
+        for (int b = 0; b < 256; b++)
+        {
+            int in = (int)CHAR_CLASS_HAS(nfa.arr[i].set, b);
+            int16_t *slot = &split[lexer->byteClasses[b]][in];
+            if (*slot < 0)
+                *slot = (int16_t)classCount++;
+            classes[b] = (uint8_t)*slot;
+        }
+        memcpy(lexer->byteClasses, classes, sizeof(classes));
+        lexer->classCount = classCount;
+    }
+    for (int b = 255; b >= 0; b--)
+        representative[lexer->byteClasses[b]] = (uint8_t)b;
+
+    // Subset construction, a DFA state is the sorted list of its NFA states. State 0 is the
+    // empty set and state 1 the closure of the start
+    uint64_t nfaCount = nfa.size, classCount = lexer->classCount;
+    uint8_t *members = (uint8_t *)TOKA_CALLOC(nfaCount, 1);
+    int *list = (int *)TOKA_MALLOC(nfaCount * sizeof(int));
+    uint64_t dfaCount = 2, dfaCapacity = 16;
+    int **sets = (int **)TOKA_MALLOC(dfaCapacity * sizeof(int *));
+    int *setSizes = (int *)TOKA_MALLOC(dfaCapacity * sizeof(int));
+    uint32_t *transitions = (uint32_t *)TOKA_MALLOC(dfaCapacity * classCount * sizeof(uint32_t));
+    int count = 0;
+    NfaClosure(&nfa, nfaStart, members, list, &count);
+    sets[0] = NULL;
+    setSizes[0] = 0;
+    sets[1] = (int *)TOKA_MALLOC(nfaCount * sizeof(int));
+    setSizes[1] = 0;
+    for (uint64_t n = 0; n < nfaCount; n++)
+    {
+        if (members[n])
+            sets[1][setSizes[1]++] = (int)n;
+    }
+    lexer->start = 1;
+    for (uint64_t from = 1; from < dfaCount; from++)
+    {
+        for (uint64_t cls = 0; cls < classCount; cls++)
+        {
+            memset(members, 0, nfaCount);
+            count = 0;
+            for (int m = 0; m < setSizes[from]; m++)
+            {
+                const NfaState *nfaState = &nfa.arr[sets[from][m]];
+                if ((nfaState->kind == NFA_SET) && CHAR_CLASS_HAS(nfaState->set, representative[cls]))
+                    NfaClosure(&nfa, nfaState->out, members, list, &count);
+            }
+            // Listing the members in order makes equal sets compare equal
+            count = 0;
+            for (uint64_t n = 0; n < nfaCount; n++)
+            {
+                if (members[n])
+                    list[count++] = (int)n;
+            }
+            uint64_t target = 0;
+            if (count > 0)
+            {
+                for (target = 1; target < dfaCount; target++)
+                {
+                    if ((setSizes[target] == count) && (memcmp(sets[target], list, count * sizeof(int)) == 0))
+                        break;
+                }
+                if (target == dfaCount)
+                {
+                    if (dfaCount == dfaCapacity)
+                    {
+                        dfaCapacity *= 2;
+                        sets = (int **)TOKA_REALLOC(sets, dfaCapacity * sizeof(int *));
+                        setSizes = (int *)TOKA_REALLOC(setSizes, dfaCapacity * sizeof(int));
+                        transitions = (uint32_t *)TOKA_REALLOC(transitions, dfaCapacity * classCount * sizeof(uint32_t));
+                    }
+                    sets[dfaCount] = (int *)TOKA_MALLOC(count * sizeof(int));
+                    memcpy(sets[dfaCount], list, count * sizeof(int));
+                    setSizes[dfaCount] = count;
+                    dfaCount++;
+                }
+            }
+            transitions[from * classCount + cls] = (uint32_t)target;
+        }
+    }
+    // The dead state never leaves itself
+    for (uint64_t cls = 0; cls < classCount; cls++)
+        transitions[cls] = 0;
+    int32_t *accepts = (int32_t *)TOKA_MALLOC(dfaCount * sizeof(int32_t));
+    for (uint64_t d = 0; d < dfaCount; d++)
+    {
+        accepts[d] = -1;
+        for (int m = 0; m < setSizes[d]; m++)
+        {
+            const NfaState *nfaState = &nfa.arr[sets[d][m]];
+            if ((nfaState->kind == NFA_ACCEPT) && ((accepts[d] < 0) || (nfaState->pattern < accepts[d])))
+                accepts[d] = nfaState->pattern;
+        }
+        TOKA_FREE(sets[d]);
+    }
+    TOKA_FREE(sets);
+    TOKA_FREE(setSizes);
+    TOKA_FREE(members);
+    TOKA_FREE(list);
+    FREE_ARRAY(nfa)
+
+    // Moore minimization: start from the states grouped by what they accept and split groups
+    // until all the states of a group go to the same groups
+    uint32_t *group = (uint32_t *)TOKA_MALLOC(dfaCount * sizeof(uint32_t));
+    uint32_t *nextGroup = (uint32_t *)TOKA_MALLOC(dfaCount * sizeof(uint32_t));
+    uint64_t groupCount = 0;
+    for (uint64_t d = 0; d < dfaCount; d++)
+    {
+        // The dead state keeps a group of its own so it stays state 0
+        uint64_t e = 1;
+        while ((e < d) && (accepts[e] != accepts[d]))
+            e++;
+        group[d] = ((d > 0) && (e < d)) ? group[e] : (uint32_t)groupCount++;
+    }
+    while (true)
+    {
+        uint64_t nextCount = 0;
+        for (uint64_t d = 0; d < dfaCount; d++)
+        {
+            uint64_t e = 0;
+            for (; e < d; e++)
+            {
+                if (group[e] != group[d])
+                    continue;
+                uint64_t cls = 0;
+                while ((cls < classCount) &&
+                       (group[transitions[d * classCount + cls]] == group[transitions[e * classCount + cls]]))
+                    cls++;
+                if (cls == classCount)
+                    break;
+            }
+            nextGroup[d] = (e < d) ? nextGroup[e] : (uint32_t)nextCount++;
+        }
+        memcpy(group, nextGroup, dfaCount * sizeof(uint32_t));
+        if (nextCount == groupCount)
+            break;
+        groupCount = nextCount;
+    }
+    // Groups are numbered in order of their first state so the dead state is group 0
+    lexer->stateCount = (uint32_t)groupCount;
+    lexer->transitions = (uint32_t *)TOKA_MALLOC(groupCount * classCount * sizeof(uint32_t));
+    lexer->accepts = (int32_t *)TOKA_MALLOC(groupCount * sizeof(int32_t));
+    for (uint64_t d = 0; d < dfaCount; d++)
+    {
+        for (uint64_t cls = 0; cls < classCount; cls++)
+            lexer->transitions[group[d] * classCount + cls] = group[transitions[d * classCount + cls]];
+        lexer->accepts[group[d]] = accepts[d];
+    }
+    lexer->start = group[lexer->start];
+    lexer->compiled = true;
+    TOKA_FREE(group);
+    TOKA_FREE(nextGroup);
+    TOKA_FREE(transitions);
+    TOKA_FREE(accepts);
+}
+
+inline void FreePatternLexer(PatternLexer *lexer)
+{
+    TOKA_FREE(lexer->transitions);
+    TOKA_FREE(lexer->accepts);
+    memset(lexer, 0, sizeof(PatternLexer));
+}
+
+/** @brief Copies the configuration and the rules (and their compiled table) of a context
+    @note The clone does not share any memory with src so it can be used on another thread
+*/
+inline ParserContext CloneParserContext(const ParserContext *src)
+{
+    ParserContext ctx = CreateParserContext(src->fileMode);
+    ctx.spanTokens = src->spanTokens;
+    if (src->useArena)
+        UseTokenArena(&ctx, src->arena.blockSize);
+    INIT_ARRAY(ParsingRule, ctx.rules, src->rules.size);
+    if (src->rules.size > 0)
+        memcpy(ctx.rules.arr, src->rules.arr, src->rules.size * sizeof(ParsingRule));
+    ctx.rules.size = src->rules.size;
+    ctx.profiling = src->profiling;
+    ResetRuleProfiles(&ctx);
+    if (src->filteringTypes)
+    {
+        ctx.keepTypes = (uint64_t *)TOKA_MALLOC(src->keepTypeWords * sizeof(uint64_t));
+        memcpy(ctx.keepTypes, src->keepTypes, src->keepTypeWords * sizeof(uint64_t));
+        ctx.keepTypeWords = src->keepTypeWords;
+        ctx.filteringTypes = true;
+    }
+    ctx.countingTypes = src->countingTypes;
+    ctx.lazyPositions = src->lazyPositions;
+    if (src->interning)
+        UseInterner(&ctx);
+    if (src->rulesCompiled)
+    {
+        INIT_ARRAY(uint16_t, ctx.ruleCandidates, src->ruleCandidates.size);
+        memcpy(ctx.ruleCandidates.arr, src->ruleCandidates.arr, src->ruleCandidates.size * sizeof(uint16_t));
+        ctx.ruleCandidates.size = src->ruleCandidates.size;
+        memcpy(ctx.ruleDispatch, src->ruleDispatch, sizeof(ctx.ruleDispatch));
+        ctx.rulesCompiled = true;
+        ctx.adaptiveOrdering = src->adaptiveOrdering;
+        if (src->candidateWins != NULL)
+        {
+            ctx.candidateWins = (uint32_t *)TOKA_MALLOC((src->ruleCandidates.size + 1) * sizeof(uint32_t));
+            memcpy(ctx.candidateWins, src->candidateWins, (src->ruleCandidates.size + 1) * sizeof(uint32_t));
+        }
+    }
+    if (src->patterns.size > 0)
+    {
+        INIT_ARRAY(TokenPattern, ctx.patterns, src->patterns.size);
+        memcpy(ctx.patterns.arr, src->patterns.arr, src->patterns.size * sizeof(TokenPattern));
+        ctx.patterns.size = src->patterns.size;
+    }
+    if (src->lexer.compiled)
+    {
+        ctx.lexer = src->lexer;
+        uint64_t tableSize = (uint64_t)src->lexer.stateCount * src->lexer.classCount;
+        ctx.lexer.transitions = (uint32_t *)TOKA_MALLOC(tableSize * sizeof(uint32_t));
+        memcpy(ctx.lexer.transitions, src->lexer.transitions, tableSize * sizeof(uint32_t));
+        ctx.lexer.accepts = (int32_t *)TOKA_MALLOC(src->lexer.stateCount * sizeof(int32_t));
+        memcpy(ctx.lexer.accepts, src->lexer.accepts, src->lexer.stateCount * sizeof(int32_t));
+    }
+    if (src->keywords.count > 0)
+    {
+        ctx.keywords = src->keywords;
+        uint64_t slotCount = (uint64_t)src->keywords.slotMask + 1;
+        ctx.keywords.slots = (Keyword *)TOKA_MALLOC(slotCount * sizeof(Keyword));
+        memcpy(ctx.keywords.slots, src->keywords.slots, slotCount * sizeof(Keyword));
+        ctx.keywords.slotLengths = (uint32_t *)TOKA_MALLOC(slotCount * sizeof(uint32_t));
+        memcpy(ctx.keywords.slotLengths, src->keywords.slotLengths, slotCount * sizeof(uint32_t));
+    }
+    return ctx;
+}
+
+inline void ResetContext(bool resetRules, ParserContext *ctx)
+{
+    if (ctx->useArena)
+    {
+        ArenaReset(&ctx->arena);
+        ctx->tokens.size = 0;
+    }
+    else
+    {
+        for (int i = 0; i < ctx->tokens.size; i++)
+        {
+            FREE_ARRAY(ctx->tokens.arr[i].value)
+        }
+        FREE_ARRAY(ctx->tokens)
+        INIT_ARRAY(Token, ctx->tokens, 0);
+    }
+    if (resetRules)
+    {
+        FREE_ARRAY(ctx->rules)
+        INIT_ARRAY(ParsingRule, ctx->rules, 0);
+        InvalidateCompiledRules(ctx);
+        FreeKeywordTable(&ctx->keywords);
+        FREE_ARRAY(ctx->patterns)
+        FreePatternLexer(&ctx->lexer);
+    }
+    CloseTokenStream(ctx);
+    if (ctx->pushing)
+        FreeInputSource(&ctx->pushInput);
+    ctx->pushing = false;
+    if (ctx->typeCounts.size > 0)
+        memset(ctx->typeCounts.arr, 0, ctx->typeCounts.size * sizeof(uint64_t));
+    ctx->skippedTokens = 0;
+    ctx->streamNext = 0;
+    ctx->furthestRead = 0;
+    ctx->stepReach = 0;
+    UnmapFile(&ctx->sourceFile);
+    FREE_ARRAY(ctx->newlines)
+    ctx->source = NULL;
+    ctx->sourceSize = 0;
+    ctx->cursorOffset = 0;
+    ctx->lineNumber = 1;
+    ctx->charNumber = 1;
+}
+
+inline void FreeParserContext(ParserContext *ctx)
+{
+    CloseTokenStream(ctx);
+    if (ctx->pushing)
+        FreeInputSource(&ctx->pushInput);
+    KeepAllTokenTypes(ctx);
+    FREE_ARRAY(ctx->typeCounts)
+    FREE_ARRAY(ctx->stepSkips)
+    UnmapFile(&ctx->sourceFile);
+    FREE_ARRAY(ctx->rules)
+    InvalidateCompiledRules(ctx);
+    FreeKeywordTable(&ctx->keywords);
+    FREE_ARRAY(ctx->patterns)
+    FreePatternLexer(&ctx->lexer);
+    if (ctx->interning)
+        FreeInterner(&ctx->interner);
+    ctx->interning = false;
+    if (ctx->useArena)
+        FreeArena(&ctx->arena);
+    else
+    {
+        for (int i = 0; i < ctx->tokens.size; i++)
+        {
+            FREE_ARRAY(ctx->tokens.arr[i].value)
+        }
+    }
+    FREE_ARRAY(ctx->tokens)
+    FREE_ARRAY(ctx->scratch)
+    FREE_ARRAY(ctx->newlines)
+}
+
+//////////////////////THREADING///////////////////////
+// Define TOKA_THREADS before including Toka.h to get the multithreaded parsing functions
+// (link with -pthread on POSIX systems)
+#if defined(TOKA_THREADS)
+#if !defined(_WIN32)
+#include <pthread.h>
+#endif
+
+typedef void (*ThreadFunction)(void *arg);
+typedef struct
+{
+#if defined(_WIN32)
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+} Thread;
+typedef struct
+{
+#if defined(_WIN32)
+    CRITICAL_SECTION handle;
+#else
+    pthread_mutex_t handle;
+#endif
+} Mutex;
+typedef struct
+{
+#if defined(_WIN32)
+    CONDITION_VARIABLE handle;
+#else
+    pthread_cond_t handle;
+#endif
+} Condition;
+
+// Cycles (see ReadCycleCounter) spent by a read-ahead parse on every side of the overlap
+typedef struct
+{
+    uint64_t stallCycles; // The lexer waiting for a block that wasn't read yet
+    uint64_t lexCycles;   // The lexer working on blocks that were ready
+    uint64_t readCycles;  // The reader thread (or the lexer without one) inside fread
+    uint64_t stalls, blocks, bytes;
+} ReadAheadStats;
+
+/** @brief Reads a file on its own thread one block ahead of the lexer (double buffering)
+    @note The lexer takes the input through ReadAheadInput, so it is parsed with an InputSource
+    and the '_R' parsing functions. Without a thread the blocks are read when they are needed
+*/
+typedef struct
+{
+    FILE *file;
+    char *blocks[2];
+    uint64_t blockSize;
+    uint64_t filled[2]; // Bytes read into each block, 0 at the end of the file
+    bool ready[2];      // The block was read and the lexer hasn't finished it
+    int current;        // Block the lexer takes its bytes from
+    bool holding;       // The lexer is using blocks[current]
+    uint64_t used;      // Bytes of blocks[current] handed out
+    bool stop, threaded;
+    Thread thread;
+    Mutex lock;
+    Condition changed;
+    uint64_t lastReturn; // When ReadAheadInput last returned, the lexer ran since then
+    ReadAheadStats stats;
+} ReadAhead;
+
+/** @brief The tokens of one file parsed by ParseFiles
+    @note ctx is a clone of the prototype context and holds the tokens (and the mapping of the
+    file in string mode), free it with FreeParserContext or FreeFileParseResults
+*/
+typedef struct
+{
+    char *path;
+    bool parsed; // false if the file could not be opened
+    ParserContext ctx;
+} FileParseResult;
+
+bool StartThread(Thread *thread, ThreadFunction func, void *arg);
+void JoinThread(Thread *thread);
+void InitMutex(Mutex *mutex);
+void LockMutex(Mutex *mutex);
+void UnlockMutex(Mutex *mutex);
+void FreeMutex(Mutex *mutex);
+void InitCondition(Condition *condition);
+// Unlocks mutex while waiting for a signal and locks it again before returning
+void WaitCondition(Condition *condition, Mutex *mutex);
+void SignalCondition(Condition *condition);
+void FreeCondition(Condition *condition);
+// Opens the file at path and starts reading it on another thread in blocks of blockSize bytes
+bool OpenReadAhead(ReadAhead *ahead, const char *path, uint64_t blockSize);
+// InputReadFunction of a ReadAhead (user is the ReadAhead)
+size_t ReadAheadInput(void *user, char *buffer, size_t size);
+void CloseReadAhead(ReadAhead *ahead);
+// Parses the file at path with the '_R' parsing functions while the next block is being read,
+// stats (if not NULL) receives where the time went
+bool ParseFileReadAhead(ParserContext *ctx, char *path, uint64_t blockSize, ReadAheadStats *stats);
+void PrintReadAheadStats(const ReadAheadStats *stats, FILE *out);
+int ProcessorCount(void);
+// Tokenizes paths[0, count) on threadCount threads (0 for one per processor)
+void ParseFiles(const ParserContext *prototype, char **paths, uint64_t count, int threadCount,
+                FileParseResult *results);
+void FreeFileParseResults(FileParseResult *results, uint64_t count);
+// Tokenizes ctx->source by splitting it in chunks parsed concurrently, same output as ParseBuffer
+void ParseBufferParallel(ParserContext *ctx, int threadCount);
+void AddRuleProfiles(ParserContext *ctx, const ParserContext *clone);
+bool ParseMappedFileParallel(ParserContext *ctx, char *path, int threadCount);
+
+typedef struct
+{
+    ThreadFunction func;
+    void *arg;
+} ThreadStart;
+
+#if defined(_WIN32)
+static DWORD WINAPI ThreadTrampoline(LPVOID param)
+#else
+static void *ThreadTrampoline(void *param)
+#endif
+{
+    ThreadStart start = *(ThreadStart *)param;
+    TOKA_FREE(param);
+    start.func(start.arg);
+    return 0;
+}
+
+inline bool StartThread(Thread *thread, ThreadFunction func, void *arg)
+{
+    ThreadStart *start = (ThreadStart *)TOKA_MALLOC(sizeof(ThreadStart));
+    start->func = func;
+    start->arg = arg;
+#if defined(_WIN32)
+    thread->handle = CreateThread(NULL, 0, ThreadTrampoline, start, 0, NULL);
+    if (thread->handle != NULL)
+        return true;
+#else
+    if (pthread_create(&thread->handle, NULL, ThreadTrampoline, start) == 0)
+        return true;
+#endif
+    TOKA_FREE(start);
+    return false;
+}
+
+inline void JoinThread(Thread *thread)
+{
+#if defined(_WIN32)
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+#else
+    pthread_join(thread->handle, NULL);
+#endif
+}
+
+inline void InitMutex(Mutex *mutex)
+{
+#if defined(_WIN32)
+    InitializeCriticalSection(&mutex->handle);
+#else
+    pthread_mutex_init(&mutex->handle, NULL);
+#endif
+}
+
+inline void LockMutex(Mutex *mutex)
+{
+#if defined(_WIN32)
+    EnterCriticalSection(&mutex->handle);
+#else
+    pthread_mutex_lock(&mutex->handle);
+#endif
+}
+
+inline void UnlockMutex(Mutex *mutex)
+{
+#if defined(_WIN32)
+    LeaveCriticalSection(&mutex->handle);
+#else
+    pthread_mutex_unlock(&mutex->handle);
+#endif
+}
+
+inline void FreeMutex(Mutex *mutex)
+{
+#if defined(_WIN32)
+    DeleteCriticalSection(&mutex->handle);
+#else
+    pthread_mutex_destroy(&mutex->handle);
+#endif
+}
+
+inline void InitCondition(Condition *condition)
+{
+#if defined(_WIN32)
+    InitializeConditionVariable(&condition->handle);
+#else
+    pthread_cond_init(&condition->handle, NULL);
+#endif
+}
+
+inline void WaitCondition(Condition *condition, Mutex *mutex)
+{
+#if defined(_WIN32)
+    SleepConditionVariableCS(&condition->handle, &mutex->handle, INFINITE);
+#else
+    pthread_cond_wait(&condition->handle, &mutex->handle);
+#endif
+}
+
+inline void SignalCondition(Condition *condition)
+{
+#if defined(_WIN32)
+    WakeAllConditionVariable(&condition->handle);
+#else
+    pthread_cond_broadcast(&condition->handle);
+#endif
+}
+
+inline void FreeCondition(Condition *condition)
+{
+#if defined(_WIN32)
+    (void)condition;
+#else
+    pthread_cond_destroy(&condition->handle);
+#endif
+}
+
+inline int ProcessorCount(void)
+{
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count > 0) ? (int)count : 1;
+#endif
+}
+
+typedef struct
+{
+    const ParserContext *prototype;
+    char **paths;
+    FileParseResult *results;
+    uint64_t count, next;
+    Mutex lock;
+} ParseFilesJob;
+
+static void ParseFilesWorker(void *arg)
+{
+    ParseFilesJob *job = (ParseFilesJob *)arg;
+    while (true)
+    {
+        LockMutex(&job->lock);
+        uint64_t i = job->next++;
+        UnlockMutex(&job->lock);
+        if (i >= job->count)
+            return;
+        FileParseResult *result = &job->results[i];
+        result->path = job->paths[i];
+        result->ctx = CloneParserContext(job->prototype);
+        if (result->ctx.fileMode)
+            result->parsed = Parse(&result->ctx, job->paths[i]);
+        else
+            result->parsed = ParseMappedFile(&result->ctx, job->paths[i]);
+    }
+}
+
+/** @brief Tokenizes a list of files in parallel
+    @note Every file is parsed by its own clone of prototype (through Parse in file mode and
+    ParseMappedFile otherwise) so the rules must not share mutable state.
+    results[i] holds the tokens of paths[i]
+*/
+inline void ParseFiles(const ParserContext *prototype, char **paths, uint64_t count, int threadCount,
+                       FileParseResult *results)
+{
+    ParseFilesJob job;
+    job.prototype = prototype;
+    job.paths = paths;
+    job.results = results;
+    job.count = count;
+    job.next = 0;
+    InitMutex(&job.lock);
+    if (threadCount <= 0)
+        threadCount = ProcessorCount();
+    if ((uint64_t)threadCount > count)
+        threadCount = (int)count;
+    Thread *threads = (Thread *)TOKA_CALLOC(threadCount, sizeof(Thread));
+    int started = 0;
+    for (int i = 1; i < threadCount; i++)
+    {
+        if (StartThread(&threads[started], ParseFilesWorker, &job))
+            started++;
+    }
+    // The calling thread works too
+    ParseFilesWorker(&job);
+    for (int i = 0; i < started; i++)
+        JoinThread(&threads[i]);
+    TOKA_FREE(threads);
+    FreeMutex(&job.lock);
+}
+
+inline void FreeFileParseResults(FileParseResult *results, uint64_t count)
+{
+    for (uint64_t i = 0; i < count; i++)
+        FreeParserContext(&results[i].ctx);
+}
+
+// Buffers smaller than this per thread are not worth splitting
+#ifndef TOKA_MIN_CHUNK_SIZE
+#define TOKA_MIN_CHUNK_SIZE (256 * 1024)
+#endif
+
+typedef struct
+{
+    ParserContext ctx; // Parses [start, end) as if it was the beginning of the input
+    uint64_t start, end;
+} ParseChunk;
+
+static void ParseChunkWorker(void *arg)
+{
+    ParseChunk *chunk = (ParseChunk *)arg;
+    chunk->ctx.cursorOffset = chunk->start;
+    ParseBufferRange(&chunk->ctx, chunk->end);
+}
+
+// Adds the rule counters of a clone of ctx to those of ctx
+inline void AddRuleProfiles(ParserContext *ctx, const ParserContext *clone)
+{
+    for (uint64_t i = 0; i <= ctx->rules.size; i++)
+    {
+        uint64_t *total = (uint64_t *)((i < ctx->rules.size) ? &ctx->rules.arr[i].profile : &ctx->patternProfile);
+        const uint64_t *part =
+            (const uint64_t *)((i < ctx->rules.size) ? &clone->rules.arr[i].profile : &clone->patternProfile);
+        for (uint64_t k = 0; k < sizeof(RuleProfile) / sizeof(uint64_t); k++)
+            total[k] += part[k];
+    }
+}
+
+// Moves chunk tokens [first, size) into ctx, shifting the positions of those found on syncLine
+static void AdoptChunkTokens(ParserContext *ctx, ParseChunk *chunk, uint64_t first,
+                             long syncLine, long lineDelta, long charDelta)
+{
+    uint64_t reachAtSync = ctx->furthestRead;
+    for (uint64_t k = first; k < chunk->ctx.tokens.size; k++)
+    {
+        Token t = chunk->ctx.tokens.arr[k];
+        // The chunks keep every token so they can be stitched, ctx drops (or counts) them here
+        if (!TokenTypeWanted(ctx, t.typeId))
+        {
+            SkipToken(ctx, t.typeId);
+            continue;
+        }
+        if (t.line == syncLine)
+            t.at += charDelta;
+        t.line += lineDelta;
+        if (t.priorReach < reachAtSync)
+            t.priorReach = reachAtSync;
+        // The chunk's arena and interner go away with it, the ids have to be the ones of ctx
+        if (ctx->interning && (t.value.arr == NULL))
+            t.symbol = InternText(&ctx->interner, ctx->source + t.offset, t.length);
+        else if ((chunk->ctx.useArena || ctx->interning) && (t.value.arr != NULL))
+            SetTokenValue(ctx, &t, t.value.arr, t.value.size - 1);
+        else
+            INIT_ARRAY(char, chunk->ctx.tokens.arr[k].value, 0); // ctx owns the value now
+        APPEND_TO_ARRAY(Token, ctx->tokens, t)
+    }
+}
+
+/** @brief Splits ctx->source in one chunk per thread, tokenizes the chunks concurrently and
+    stitches the results so they are identical to a sequential ParseBuffer
+    @note Chunks start after a newline and are parsed as if they were the start of the input.
+    When the token before a chunk boundary runs past it (e.g. a block comment or string), the
+    part of the next chunk it covers is re-parsed sequentially until it reaches a position where
+    the chunk also started a token, after which the chunk's tokens are used with their line and
+    character numbers shifted. This requires that rules only depend on the source and the cursor
+    (not on earlier tokens) and that a token's line/at are the context's values when its rule
+    started, which is the case for the C example rules
+*/
+inline void ParseBufferParallel(ParserContext *ctx, int threadCount)
+{
+    uint64_t start = ctx->cursorOffset, size = ctx->sourceSize;
+    if (threadCount <= 0)
+        threadCount = ProcessorCount();
+    if ((size - start) / TOKA_MIN_CHUNK_SIZE < (uint64_t)threadCount)
+        threadCount = (int)((size - start) / TOKA_MIN_CHUNK_SIZE);
+    if (threadCount <= 1)
+    {
+        ParseBuffer(ctx);
+        return;
+    }
+    ParseChunk *chunks = (ParseChunk *)TOKA_CALLOC(threadCount, sizeof(ParseChunk));
+    int chunkCount = 0;
+    uint64_t chunkStart = start;
+    for (int i = 1; i <= threadCount; i++)
+    {
+        uint64_t chunkEnd = size;
+        if (i < threadCount)
+        {
+            chunkEnd = start + ((size - start) / threadCount) * i;
+            char *newLine = (char *)memchr(ctx->source + chunkEnd, '\n', size - chunkEnd);
+            chunkEnd = (newLine != NULL) ? (uint64_t)(newLine - ctx->source) + 1 : size;
+        }
+        if (chunkEnd <= chunkStart)
+            continue;
+        ParseChunk *chunk = &chunks[chunkCount++];
+        chunk->ctx = CloneParserContext(ctx);
+        KeepAllTokenTypes(&chunk->ctx);
+        chunk->ctx.countingTypes = false;
+        chunk->ctx.source = ctx->source;
+        chunk->ctx.sourceSize = size;
+        chunk->start = chunkStart;
+        chunk->end = chunkEnd;
+        chunkStart = chunkEnd;
+    }
+    Thread *threads = (Thread *)TOKA_CALLOC(chunkCount, sizeof(Thread));
+    bool *started = (bool *)TOKA_CALLOC(chunkCount, sizeof(bool));
+    for (int i = 1; i < chunkCount; i++)
+        started[i] = StartThread(&threads[i], ParseChunkWorker, &chunks[i]);
+    ParseChunkWorker(&chunks[0]);
+    for (int i = 1; i < chunkCount; i++)
+    {
+        if (started[i])
+            JoinThread(&threads[i]);
+        else
+            ParseChunkWorker(&chunks[i]);
+    }
+
+    // Stitch the chunks in order. ctx->cursorOffset is where the sequential parse is
+    for (int i = 0; i < chunkCount; i++)
+    {
+        ParseChunk *chunk = &chunks[i];
+        ParserContext *chunkCtx = &chunk->ctx;
+        long syncLine = 1, syncChar = 1;
+        uint64_t k = 0;
+        bool synced = ((uint64_t)ctx->cursorOffset == chunk->start);
+        while (!synced && ((uint64_t)ctx->cursorOffset < chunk->end))
+        {
+            while ((k < chunkCtx->tokens.size) && (chunkCtx->tokens.arr[k].offset < (uint64_t)ctx->cursorOffset))
+                k++;
+            if ((k < chunkCtx->tokens.size) && (chunkCtx->tokens.arr[k].offset == (uint64_t)ctx->cursorOffset))
+            {
+                syncLine = chunkCtx->tokens.arr[k].line;
+                syncChar = chunkCtx->tokens.arr[k].at;
+                synced = true;
+            }
+            else
+                ParseBufferStep(ctx);
+        }
+        if (synced)
+        {
+            long lineDelta = (long)ctx->lineNumber - syncLine;
+            long charDelta = (long)ctx->charNumber - syncChar;
+            AdoptChunkTokens(ctx, chunk, k, syncLine, lineDelta, charDelta);
+            ctx->cursorOffset = chunkCtx->cursorOffset;
+            ctx->charNumber = chunkCtx->charNumber + (((long)chunkCtx->lineNumber == syncLine) ? charDelta : 0);
+            ctx->lineNumber = chunkCtx->lineNumber + lineDelta;
+            if (chunkCtx->furthestRead > ctx->furthestRead)
+                ctx->furthestRead = chunkCtx->furthestRead;
+        }
+        if (ctx->profiling)
+            AddRuleProfiles(ctx, chunkCtx);
+        FreeParserContext(chunkCtx);
+    }
+    TOKA_FREE(threads);
+    TOKA_FREE(started);
+    TOKA_FREE(chunks);
+}
+
+inline bool ParseMappedFileParallel(ParserContext *ctx, char *path, int threadCount)
+{
+    UnmapFile(&ctx->sourceFile);
+    if (!MapFile(path, &ctx->sourceFile))
+        return false;
+    ctx->source = ctx->sourceFile.data;
+    ctx->sourceSize = ctx->sourceFile.size;
+    ctx->cursorOffset = 0;
+    ParseBufferParallel(ctx, threadCount);
+    return true;
+}
+
+// Fills the blocks in turn, each one as soon as the lexer is done with it
+static void ReadAheadWorker(void *arg)
+{
+    ReadAhead *ahead = (ReadAhead *)arg;
+    int next = 0;
+    while (true)
+    {
+        LockMutex(&ahead->lock);
+        while (ahead->ready[next] && !ahead->stop)
+            WaitCondition(&ahead->changed, &ahead->lock);
+        bool stop = ahead->stop;
+        UnlockMutex(&ahead->lock);
+        if (stop)
+            return;
+        uint64_t start = ReadCycleCounter();
+        uint64_t got = fread(ahead->blocks[next], 1, ahead->blockSize, ahead->file);
+        uint64_t cycles = ReadCycleCounter() - start;
+        LockMutex(&ahead->lock);
+        ahead->stats.readCycles += cycles;
+        ahead->filled[next] = got;
+        ahead->ready[next] = true;
+        SignalCondition(&ahead->changed);
+        UnlockMutex(&ahead->lock);
+        if (got == 0)
+            return;
+        next ^= 1;
+    }
+}
+
+inline bool OpenReadAhead(ReadAhead *ahead, const char *path, uint64_t blockSize)
+{
+    memset(ahead, 0, sizeof(ReadAhead));
+    ahead->file = fopen(path, "rb");
+    if (ahead->file == NULL)
+        return false;
+    ahead->blockSize = (blockSize > 0) ? blockSize : 1 << 20;
+    ahead->blocks[0] = (char *)TOKA_MALLOC(2 * ahead->blockSize);
+    ahead->blocks[1] = ahead->blocks[0] + ahead->blockSize;
+    InitMutex(&ahead->lock);
+    InitCondition(&ahead->changed);
+    ahead->threaded = StartThread(&ahead->thread, ReadAheadWorker, ahead);
+    ahead->lastReturn = ReadCycleCounter();
+    return true;
+}
+
+/** @brief Hands out the bytes of the current block, and waits for the next one when it is used up
+    @note The time since the previous call counts as lexing and the time spent waiting as stalled
+*/
+inline size_t ReadAheadInput(void *user, char *buffer, size_t size)
+{
+    ReadAhead *ahead = (ReadAhead *)user;
+    uint64_t now = ReadCycleCounter();
+    ahead->stats.lexCycles += now - ahead->lastReturn;
+    if (!ahead->holding || (ahead->used == ahead->filled[ahead->current]))
+    {
+        if (ahead->threaded)
+        {
+            LockMutex(&ahead->lock);
+            if (ahead->holding)
+            {
+                ahead->ready[ahead->current] = false;
+                ahead->current ^= 1;
+                SignalCondition(&ahead->changed);
+            }
+            if (!ahead->ready[ahead->current])
+            {
+                ahead->stats.stalls++;
+                while (!ahead->ready[ahead->current])
+                    WaitCondition(&ahead->changed, &ahead->lock);
+            }
+            UnlockMutex(&ahead->lock);
+        }
+        else
+        {
+            // No thread, the lexer reads the block itself
+            ahead->current ^= ahead->holding;
+            ahead->filled[ahead->current] = fread(ahead->blocks[ahead->current], 1, ahead->blockSize, ahead->file);
+            ahead->stats.stalls++;
+            ahead->stats.readCycles += ReadCycleCounter() - now;
+        }
+        ahead->holding = true;
+        ahead->used = 0;
+        ahead->stats.stallCycles += ReadCycleCounter() - now;
+        if (ahead->filled[ahead->current] > 0)
+        {
+            ahead->stats.blocks++;
+            ahead->stats.bytes += ahead->filled[ahead->current];
+        }
+    }
+    uint64_t count = ahead->filled[ahead->current] - ahead->used;
+    if (count > size)
+        count = size;
+    memcpy(buffer, ahead->blocks[ahead->current] + ahead->used, count);
+    ahead->used += count;
+    ahead->lastReturn = ReadCycleCounter();
+    return count;
+}
+
+inline void CloseReadAhead(ReadAhead *ahead)
+{
+    if (ahead->threaded)
+    {
+        LockMutex(&ahead->lock);
+        ahead->stop = true;
+        SignalCondition(&ahead->changed);
+        UnlockMutex(&ahead->lock);
+        JoinThread(&ahead->thread);
+    }
+    FreeCondition(&ahead->changed);
+    FreeMutex(&ahead->lock);
+    TOKA_FREE(ahead->blocks[0]);
+    fclose(ahead->file);
+    memset(ahead, 0, sizeof(ReadAhead));
+}
+
+inline bool ParseFileReadAhead(ParserContext *ctx, char *path, uint64_t blockSize, ReadAheadStats *stats)
+{
+    ReadAhead ahead;
+    if (!OpenReadAhead(&ahead, path, blockSize))
+        return false;
+    // The ring only has to hold the longest token a rule goes back over, not a whole block
+    InputSource in = CreateInputSource(ReadAheadInput, &ahead, 64 * 1024);
+    ParseReader(ctx, &in);
+    FreeInputSource(&in);
+    if (stats != NULL)
+        *stats = ahead.stats;
+    CloseReadAhead(&ahead);
+    return true;
+}
+
+inline void PrintReadAheadStats(const ReadAheadStats *stats, FILE *out)
+{
+    uint64_t total = stats->stallCycles + stats->lexCycles;
+    fprintf(out, "%llu bytes in %llu blocks, stalled %llu times\n", (unsigned long long)stats->bytes,
+            (unsigned long long)stats->blocks, (unsigned long long)stats->stalls);
+    fprintf(out, "stalled on I/O: %llu cycles (%.1f%%), lexing: %llu cycles, reading: %llu cycles\n",
+            (unsigned long long)stats->stallCycles, (total > 0) ? 100.0 * stats->stallCycles / total : 0.0,
+            (unsigned long long)stats->lexCycles, (unsigned long long)stats->readCycles);
 }
+#endif
+//////////////////////THREADING END///////////////////////
 
 /////////////////////////////////////////////////////////
 
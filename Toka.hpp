@@ -0,0 +1,210 @@
+/**
+ * @file Toka.hpp
+ * @brief C++17 front end of Toka.h where the rule set is known at compile time
+ *
+ * A grammar is a list of rule types given to toka::Lexer:
+ *
+ *     using CLexer = toka::Lexer<toka::Rule<IsStringStart, ConsumeString_S>,
+ *                                toka::ClassRule<&WhiteSpaceClass, ConsumeWhiteSpace_S>>;
+ *     CLexer::ParseMappedFile(&ctx, "file.c");
+ *
+ * The conditions and parsing functions are template arguments instead of function pointers
+ * stored in the context, so the compiler sees every call of the main loop and can inline the
+ * rules into it. The rules are tried in the order they are listed, exactly like rules added
+ * with AddParseRule, and the tokens end up in the same ParserContext (so everything else in
+ * Toka.h works on them).
+ */
+#ifndef TOKA_HPP
+#define TOKA_HPP
+#include "Toka.h"
+#include <cstddef>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace toka
+{
+/** @brief A rule made of a condition function and a string ('_S') or file ('_F') parsing function
+*/
+template <bool (*Condition)(char), auto Consume>
+struct Rule
+{
+    static bool Accepts(char c) { return Condition(c); }
+    static constexpr auto consume = Consume;
+    static void Register(ParserContext *ctx, char *name)
+    {
+        ParsingFunction pf;
+        if constexpr (std::is_same_v<decltype(Consume), StringParsingFunction>)
+            pf.stringFunction = Consume;
+        else
+            pf.fileFunction = Consume;
+        AddParseRule(ctx, name, Condition, pf);
+    }
+};
+
+/** @brief A rule that starts on the characters of a CharClass (like AddClassParseRule)
+    @note The class is read when the lexer builds its dispatch table, so it has to be filled in
+    before the first parse
+*/
+template <const CharClass *Class, auto Consume>
+struct ClassRule
+{
+    static bool Accepts(char c) { return CHAR_CLASS_HAS(*Class, c); }
+    static constexpr auto consume = Consume;
+    static void Register(ParserContext *ctx, char *name)
+    {
+        ParsingFunction pf;
+        if constexpr (std::is_same_v<decltype(Consume), StringParsingFunction>)
+            pf.stringFunction = Consume;
+        else
+            pf.fileFunction = Consume;
+        AddClassParseRule(ctx, name, *Class, pf);
+    }
+};
+
+/** @brief A lexer specialized for the rules Rules
+    @note Every byte is looked up in a table of the rules whose condition accepts it (built once,
+    the first time the lexer runs, since conditions may depend on tables filled at runtime), then
+    the accepted rules are tried through a fold expression of direct calls. The string functions
+    also give the context's compiled patterns the first shot, like ParseBufferStep. Profiling and
+    adaptive ordering are only done by the runtime path
+*/
+template <typename... Rules>
+class Lexer
+{
+    static_assert(sizeof...(Rules) > 0, "A lexer needs at least one rule");
+    static_assert(sizeof...(Rules) <= 32, "The dispatch table holds at most 32 rules");
+    static constexpr bool stringRules = (std::is_same_v<decltype(Rules::consume), const StringParsingFunction> && ...);
+    static constexpr bool fileRules = (std::is_same_v<decltype(Rules::consume), const FileParsingFunction> && ...);
+    static_assert(stringRules || fileRules, "The rules of a lexer must all be string rules or all file rules");
+
+    struct Dispatch
+    {
+        uint32_t candidates[256]; // Bit i is set if rule i accepts the byte
+        Dispatch()
+        {
+            for (int b = 0; b < 256; b++)
+                candidates[b] = Mask((char)b, std::index_sequence_for<Rules...>{});
+        }
+        template <std::size_t... I>
+        static uint32_t Mask(char c, std::index_sequence<I...>)
+        {
+            return ((Rules::Accepts(c) ? (1u << I) : 0u) | ...);
+        }
+    };
+    static const Dispatch &Table()
+    {
+        static const Dispatch table;
+        return table;
+    }
+
+    template <std::size_t I>
+    using RuleAt = std::tuple_element_t<I, std::tuple<Rules...>>;
+
+    // Runs rule I, true if it consumed something
+    template <std::size_t I, typename Input>
+    static bool TryRule(ParserContext *ctx, char c, Input input)
+    {
+        long cursorPos = ctx->cursorOffset;
+        RuleAt<I>::consume(ctx, c, input);
+        return ctx->cursorOffset != cursorPos;
+    }
+    // Tries the candidates in order and stops at the first success
+    template <typename Input, std::size_t... I>
+    static void TryRules(ParserContext *ctx, char c, Input input, uint32_t mask, std::index_sequence<I...>)
+    {
+        (void)((((mask >> I) & 1u) && TryRule<I>(ctx, c, input)) || ...);
+    }
+
+public:
+    static constexpr std::size_t ruleCount = sizeof...(Rules);
+
+    // Same as ParseBufferStep with the context's rules replaced by Rules
+    static void ParseBufferStep(ParserContext *ctx)
+    {
+        static_assert(stringRules, "ParseBufferStep needs string parsing functions");
+        char *src = ctx->source;
+        long cursorPos = ctx->cursorOffset;
+        char c = src[cursorPos];
+        ctx->stepReach = ctx->furthestRead;
+        if (ctx->lexer.compiled && MatchPatterns(ctx))
+            return;
+        TryRules(ctx, c, src, Table().candidates[(unsigned char)c], std::index_sequence_for<Rules...>{});
+        if (ctx->cursorOffset == cursorPos)
+            ctx->cursorOffset++;
+        NOTE_READ(ctx, ctx->cursorOffset)
+    }
+
+    // Same as ParseFileStep with the context's rules replaced by Rules
+    static bool ParseFileStep(ParserContext *ctx, FILE *file)
+    {
+        static_assert(fileRules, "ParseFileStep needs file parsing functions");
+        char c = fgetc(file);
+        if (c == EOF)
+            return false;
+        ctx->cursorOffset = ftell(file);
+        TryRules(ctx, c, file, Table().candidates[(unsigned char)c], std::index_sequence_for<Rules...>{});
+        return true;
+    }
+
+    static void ParseBuffer(ParserContext *ctx)
+    {
+        while ((uint64_t)ctx->cursorOffset < ctx->sourceSize)
+            ParseBufferStep(ctx);
+    }
+
+    // Same meaning of src as Parse: a path for file rules, the text itself for string rules
+    static bool Parse(ParserContext *ctx, char *src)
+    {
+        if constexpr (fileRules)
+        {
+            FILE *file = fopen(src, "r");
+            if (file == NULL)
+                return false;
+            while (ParseFileStep(ctx, file))
+                ;
+            fclose(file);
+        }
+        else
+        {
+            if (ctx->source != src)
+            {
+                ctx->source = src;
+                ctx->sourceSize = strlen(src);
+            }
+            ParseBuffer(ctx);
+        }
+        return true;
+    }
+
+    static bool ParseMappedFile(ParserContext *ctx, char *path)
+    {
+        static_assert(stringRules, "ParseMappedFile needs string parsing functions");
+        UnmapFile(&ctx->sourceFile);
+        if (!MapFile(path, &ctx->sourceFile))
+            return false;
+        ctx->source = ctx->sourceFile.data;
+        ctx->sourceSize = ctx->sourceFile.size;
+        ctx->cursorOffset = 0;
+        ParseBuffer(ctx);
+        return true;
+    }
+
+    /** @brief Adds the rules to ctx as runtime rules, for the functions that run the context's
+        own rules (Retokenize, NextToken, ParseBufferParallel...) or identify them (RuleFingerprint)
+        @note names gives the rule names in order, NULL leaves them unnamed
+    */
+    static void Register(ParserContext *ctx, char *const *names = NULL)
+    {
+        RegisterRules(ctx, names, std::index_sequence_for<Rules...>{});
+    }
+
+private:
+    template <std::size_t... I>
+    static void RegisterRules(ParserContext *ctx, char *const *names, std::index_sequence<I...>)
+    {
+        (RuleAt<I>::Register(ctx, (names != NULL) ? names[I] : NULL), ...);
+    }
+};
+} // namespace toka
+#endif